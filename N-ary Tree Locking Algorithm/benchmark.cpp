@@ -0,0 +1,1106 @@
+#include "nary_tree_lock.h"
+#include "trace_recorder.h"
+#include "unlock_notifier.h"
+#include "latency_histogram.h"
+#include "nary_forest.h"
+#include "lock_batch.h"
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <filesystem>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using namespace std;
+
+// ANSI Color codes for better output
+#define GREEN "\033[32m"
+#define RED "\033[31m"
+#define YELLOW "\033[33m"
+#define BLUE "\033[34m"
+#define RESET "\033[0m"
+
+/**
+ * Benchmark driver for the locking engine
+ *
+ * Built with NARY_TREE_LOCK_STATS so the per-thread contention counters
+ * (LockStats) are populated. Usage:
+ *   tree_lock_bench                  run every scenario
+ *   tree_lock_bench <name>           run one scenario
+ *   tree_lock_bench trace <file>     keep the captured trace in <file>
+ */
+
+// Set by a scenario whose result is invalid; main() then exits non-zero
+bool bench_failed = false;
+
+// Where the trace scenario writes its trace (empty: the temp directory)
+string trace_path;
+
+void printBenchHeader(const string& header) {
+    cout << "\n" << BLUE << "=== " << header << " ===" << RESET << endl;
+}
+
+/**
+ * Number of nodes in a complete k-ary tree with the given number of levels
+ */
+int countNodes(int arity, int levels) {
+    int count = 0;
+    int level_size = 1;
+    for (int level = 0; level < levels; level++) {
+        count += level_size;
+        level_size *= arity;
+    }
+    return count;
+}
+
+/**
+ * Build a complete k-ary tree with the given number of levels
+ * Node i has parent (i - 1) / k, so children of i are k*i+1 .. k*i+k
+ */
+void buildKaryTree(NaryTreeLock& tree, int arity, int levels) {
+    vector<string> names;
+    vector<int> parents;
+    int count = countNodes(arity, levels);
+
+    for (int i = 0; i < count; i++) {
+        names.push_back("Node_" + to_string(i));
+        parents.push_back(i == 0 ? -1 : (i - 1) / arity);
+    }
+
+    tree.buildTree(names, parents);
+}
+
+/**
+ * Verify every owner and descendant counter is back to zero
+ */
+bool treeIsClear(NaryTreeLock& tree, int node_count) {
+    for (int i = 0; i < node_count; i++) {
+        TreeNode* node = tree.getNode(i);
+        if (node->lockedBy() != -1 || node->lockedDescendantCount() != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Lock protocol from before the packed state word, kept as the stress
+ * scenario's baseline: separate owner and descendant-count atomics, the
+ * node is claimed first and given back with store(-1) if a descendant or
+ * ancestor turns out to be locked, and ancestor counts are bumped after.
+ * Rollbacks are counted in the calling thread's LockStats.
+ */
+class BaselineTreeLock {
+private:
+    struct Node {
+        std::atomic<int> locked_by{-1};
+        std::atomic<int> locked_descendant_count{0};
+        int parent = -1;
+    };
+
+    unique_ptr<Node[]> nodes;
+    int node_count;
+
+    void updateAncestorCount(int node_id, int delta) {
+        for (int curr = nodes[node_id].parent; curr != -1; curr = nodes[curr].parent) {
+            nodes[curr].locked_descendant_count.fetch_add(delta);
+        }
+    }
+
+public:
+    // Complete k-ary tree shaped like buildKaryTree
+    BaselineTreeLock(int arity, int levels) : node_count(countNodes(arity, levels)) {
+        nodes.reset(new Node[node_count]);
+        for (int i = 1; i < node_count; i++) {
+            nodes[i].parent = (i - 1) / arity;
+        }
+    }
+
+    bool lock(int node_id, int user_id) {
+        LockStats& stats = NaryTreeLock::threadStats();
+        stats.lock_attempts++;
+
+        Node& node = nodes[node_id];
+        int expected = -1;
+        if (!node.locked_by.compare_exchange_strong(expected, user_id)) {
+            return false;
+        }
+
+        if (node.locked_descendant_count.load() > 0) {
+            node.locked_by.store(-1);
+            stats.rollbacks++;
+            return false;
+        }
+
+        for (int curr = node.parent; curr != -1; curr = nodes[curr].parent) {
+            if (nodes[curr].locked_by.load() != -1) {
+                node.locked_by.store(-1);
+                stats.rollbacks++;
+                return false;
+            }
+        }
+
+        updateAncestorCount(node_id, 1);
+        return true;
+    }
+
+    bool unlock(int node_id, int user_id) {
+        int expected = user_id;
+        if (!nodes[node_id].locked_by.compare_exchange_strong(expected, -1)) {
+            return false;
+        }
+        updateAncestorCount(node_id, -1);
+        return true;
+    }
+
+    bool isClear() const {
+        for (int i = 0; i < node_count; i++) {
+            if (nodes[i].locked_by.load() != -1 || nodes[i].locked_descendant_count.load() != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/**
+ * Run the stress threads against one engine and print their counters
+ */
+template <typename Engine>
+void runStress(Engine& engine, const vector<int>& targets, int iterations) {
+    int thread_count = static_cast<int>(targets.size());
+    vector<LockStats> stats(thread_count);
+    vector<long long> successes(thread_count, 0);
+
+    auto thread_func = [&](int index) {
+        int user_id = index + 1;
+        int node_id = targets[index];
+        NaryTreeLock::threadStats() = LockStats();
+
+        for (int i = 0; i < iterations; i++) {
+            if (engine.lock(node_id, user_id)) {
+                successes[index]++;
+                for (volatile int spin = 0; spin < 50; spin++) {
+                }
+                engine.unlock(node_id, user_id);
+            }
+        }
+
+        stats[index] = NaryTreeLock::threadStats();
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+        threads.push_back(thread(thread_func, t));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto end = chrono::steady_clock::now();
+
+    LockStats total;
+    long long total_successes = 0;
+    for (int t = 0; t < thread_count; t++) {
+        total.lock_attempts += stats[t].lock_attempts;
+        total.cas_retries += stats[t].cas_retries;
+        total.rollbacks += stats[t].rollbacks;
+        total_successes += successes[t];
+    }
+
+    double seconds = chrono::duration<double>(end - start).count();
+    double per_k = total.lock_attempts ? 1000.0 / total.lock_attempts : 0.0;
+
+    cout << fixed << setprecision(2);
+    cout << "  Lock attempts:      " << total.lock_attempts << endl;
+    cout << "  Successful locks:   " << total_successes << endl;
+    cout << "  Rollbacks:          " << total.rollbacks
+         << " (" << total.rollbacks * per_k << " per 1k attempts)" << endl;
+    cout << "  CAS retries:        " << total.cas_retries
+         << " (" << total.cas_retries * per_k << " per 1k attempts)" << endl;
+    cout << "  Elapsed:            " << seconds * 1000.0 << " ms" << endl;
+    cout << "  Throughput:         " << total.lock_attempts / seconds / 1e6 << " M attempts/s" << endl;
+}
+
+/**
+ * Scenario: multithreading stress test, scaled up
+ *
+ * Same shape as testMultithreading (threads hammering fixed nodes, some of
+ * them related as ancestor/descendant) but with 16 threads on a
+ * 5461-node 4-ary tree. Thread 2g locks level-2 node g while thread 2g+1
+ * locks a leaf beneath it, so every pair genuinely conflicts. The same
+ * workload runs on BaselineTreeLock first for comparison.
+ */
+void benchStress() {
+    printBenchHeader("Stress: 16 threads, 5461-node 4-ary tree");
+
+    const int arity = 4;
+    const int levels = 7;
+    const int thread_count = 16;
+    const int iterations = 20000;
+    int node_count = countNodes(arity, levels);
+
+    vector<int> targets(thread_count);
+    for (int g = 0; g < thread_count / 2; g++) {
+        int upper = 5 + g;  // level-2 nodes are 5..20
+        int leaf = upper;
+        while (arity * leaf + 1 < node_count) {
+            leaf = arity * leaf + 1;
+        }
+        targets[2 * g] = upper;
+        targets[2 * g + 1] = leaf;
+    }
+
+    cout << "Baseline (separate owner/count atomics, store(-1) rollback)" << endl;
+    BaselineTreeLock baseline(arity, levels);
+    runStress(baseline, targets, iterations);
+    bool baseline_clear = baseline.isClear();
+    cout << "  " << (baseline_clear ? GREEN "[OK] " : RED "[BROKEN] ") << RESET
+         << "Counters cleared after run" << endl;
+    if (!baseline_clear) {
+        bench_failed = true;
+    }
+
+    cout << "Packed state word" << endl;
+    NaryTreeLock tree;
+    buildKaryTree(tree, arity, levels);
+    runStress(tree, targets, iterations);
+    bool clear = treeIsClear(tree, node_count);
+    cout << "  " << (clear ? GREEN "[OK] " : RED "[BROKEN] ") << RESET
+         << "Counters cleared after run" << endl;
+    if (!clear) {
+        bench_failed = true;
+    }
+}
+
+/**
+ * Mixed random workload used for trace capture: lock a random node, and on
+ * success either unlock it or lock a sibling subtree and upgrade the parent
+ */
+double runMixedWorkload(NaryTreeLock& tree, int node_count, int thread_count, int iterations) {
+    auto thread_func = [&](int index) {
+        int user_id = index + 1;
+        unsigned int seed = 2654435761u * user_id;
+
+        for (int i = 0; i < iterations; i++) {
+            seed = seed * 1103515245u + 12345u;
+            int node_id = (seed >> 8) % node_count;
+
+            if (!tree.lock(node_id, user_id)) {
+                continue;
+            }
+
+            TreeNode* parent = tree.getNode(node_id)->parent;
+            if ((seed & 0x7) == 0 && parent) {
+                if (!tree.upgradeLock(parent->id, user_id)) {
+                    tree.unlock(node_id, user_id);
+                } else {
+                    tree.unlock(parent->id, user_id);
+                }
+            } else {
+                tree.unlock(node_id, user_id);
+            }
+        }
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+        threads.push_back(thread(thread_func, t));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Scenario: trace capture overhead
+ *
+ * Runs the mixed workload with and without a TraceRecorder attached and
+ * leaves the trace for trace_replay, in trace_path or the temp directory.
+ */
+void benchTrace() {
+    printBenchHeader("Trace capture: 8 threads, 1365-node 4-ary tree");
+
+    const int arity = 4;
+    const int levels = 6;
+    const int thread_count = 8;
+    const int iterations = 50000;
+    const string path = trace_path.empty()
+        ? (std::filesystem::temp_directory_path() / "tree_lock_trace.bin").string()
+        : trace_path;
+
+    int node_count = countNodes(arity, levels);
+    vector<int> parents;
+    for (int i = 0; i < node_count; i++) {
+        parents.push_back(i == 0 ? -1 : (i - 1) / arity);
+    }
+
+    NaryTreeLock plain;
+    buildKaryTree(plain, arity, levels);
+    double plain_seconds = runMixedWorkload(plain, node_count, thread_count, iterations);
+
+    NaryTreeLock traced;
+    buildKaryTree(traced, arity, levels);
+    double traced_seconds;
+    uint64_t dropped;
+    {
+        TraceRecorder recorder(path, parents);
+        traced.setTraceRecorder(&recorder);
+        traced_seconds = runMixedWorkload(traced, node_count, thread_count, iterations);
+        traced.setTraceRecorder(nullptr);
+        dropped = recorder.droppedRecords();
+    }
+
+    TraceReader trace(path);
+
+    cout << fixed << setprecision(2);
+    cout << "Without recorder:   " << plain_seconds * 1000.0 << " ms" << endl;
+    cout << "With recorder:      " << traced_seconds * 1000.0 << " ms ("
+         << (traced_seconds / plain_seconds - 1.0) * 100.0 << "% overhead)" << endl;
+    cout << "Records written:    " << trace.recordCount() << " ("
+         << trace.recordCount() * sizeof(TraceRecord) / 1024 << " KiB), dropped: "
+         << dropped << endl;
+    cout << "Replay with:        trace_replay " << path << " --speed max" << endl;
+
+    if (dropped > 0 || trace.droppedRecords() != dropped) {
+        cout << RED << "[BROKEN] " << RESET << "Recorder dropped records; the trace is lossy" << endl;
+        bench_failed = true;
+    }
+}
+
+/**
+ * Leaf-heavy workload for escalation: 8 users each lock every leaf under
+ * their own 8 parents (256 leaves per parent, depth 4), then unlock them,
+ * while a ninth user pokes at random leaves
+ */
+void runLeafHeavy(const EscalationPolicy& policy, const string& label) {
+    const int parent_count = 64;
+    const int leaves_per_parent = 256;
+    const int users = 8;
+    const int rounds = 5;
+
+    // Levels: root, 4, 16, 64 parents, then leaves
+    vector<string> names;
+    vector<int> parents;
+    for (int i = 0; i < 1 + 4 + 16 + parent_count; i++) {
+        names.push_back("Node_" + to_string(i));
+        parents.push_back(i == 0 ? -1 : (i - 1) / 4);
+    }
+    int first_parent = 1 + 4 + 16;
+    int first_leaf = static_cast<int>(names.size());
+    for (int p = 0; p < parent_count; p++) {
+        for (int l = 0; l < leaves_per_parent; l++) {
+            names.push_back("Leaf_" + to_string(p) + "_" + to_string(l));
+            parents.push_back(first_parent + p);
+        }
+    }
+    int node_count = static_cast<int>(names.size());
+
+    NaryTreeLock tree;
+    tree.buildTree(names, parents);
+    tree.setEscalationPolicy(policy);
+
+    vector<LockStats> stats(users);
+    vector<int> peak_root(users, 0);
+    atomic<bool> done(false);
+    atomic<long long> intruder_locks(0);
+
+    auto owner_func = [&](int index) {
+        int user_id = index + 1;
+        NaryTreeLock::threadStats() = LockStats();
+
+        for (int round = 0; round < rounds; round++) {
+            for (int p = index * 8; p < index * 8 + 8; p++) {
+                for (int l = 0; l < leaves_per_parent; l++) {
+                    tree.lock(first_leaf + p * leaves_per_parent + l, user_id);
+                }
+            }
+            peak_root[index] = max(peak_root[index], tree.getNode(0)->lockedDescendantCount());
+            for (int p = index * 8; p < index * 8 + 8; p++) {
+                for (int l = 0; l < leaves_per_parent; l++) {
+                    tree.unlock(first_leaf + p * leaves_per_parent + l, user_id);
+                }
+            }
+        }
+
+        stats[index] = NaryTreeLock::threadStats();
+    };
+
+    auto intruder_func = [&]() {
+        unsigned int seed = 99991u;
+        while (!done.load()) {
+            seed = seed * 1103515245u + 12345u;
+            int leaf = first_leaf + (seed >> 8) % (parent_count * leaves_per_parent);
+            if (tree.lock(leaf, 1000)) {
+                intruder_locks++;
+                tree.unlock(leaf, 1000);
+            }
+        }
+    };
+
+    auto start = chrono::steady_clock::now();
+    thread intruder(intruder_func);
+    vector<thread> threads;
+    for (int t = 0; t < users; t++) {
+        threads.push_back(thread(owner_func, t));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto end = chrono::steady_clock::now();
+    done = true;
+    intruder.join();
+
+    LockStats total;
+    int peak = 0;
+    for (int t = 0; t < users; t++) {
+        total.ancestor_rmws += stats[t].ancestor_rmws;
+        total.escalations += stats[t].escalations;
+        total.rollbacks += stats[t].rollbacks;
+        peak = max(peak, peak_root[t]);
+    }
+
+    double operations = 2.0 * users * rounds * 8 * leaves_per_parent;
+    double seconds = chrono::duration<double>(end - start).count();
+
+    cout << fixed << setprecision(2);
+    cout << label << endl;
+    cout << "  Ancestor RMWs per lock/unlock: " << total.ancestor_rmws / operations << endl;
+    cout << "  Peak root descendant count:    " << peak << endl;
+    cout << "  Escalations:                   " << total.escalations << endl;
+    cout << "  Owner elapsed:                 " << seconds * 1000.0 << " ms ("
+         << operations / seconds / 1e6 << " M ops/s)" << endl;
+    cout << "  Intruder locks granted:        " << intruder_locks << endl;
+
+    bool clear = treeIsClear(tree, node_count);
+    cout << "  " << (clear ? GREEN "[OK] " : RED "[BROKEN] ") << RESET
+         << "Counters cleared after run" << endl;
+    if (!clear) {
+        bench_failed = true;
+    }
+}
+
+/**
+ * Scenario: automatic lock escalation on a leaf-heavy workload
+ *
+ * Counter memory is fixed per node (one packed word), so the footprint
+ * effect shows up as counter inflation: without escalation the root count
+ * grows with every leaf held; with it each escalated parent counts once.
+ */
+void benchEscalation() {
+    printBenchHeader("Escalation: 8 users x 2048 leaves, 16469-node tree");
+
+    runLeafHeavy(EscalationPolicy(), "Escalation off");
+
+    EscalationPolicy policy;
+    policy.max_locked_descendants = 32;
+    runLeafHeavy(policy, "Escalation at 32 locked leaves per parent");
+}
+
+/**
+ * Leaf IDs [lo, hi] under a node of a complete k-ary tree built by
+ * buildKaryTree, where the node sits at the given depth
+ */
+void leafRange(int arity, int levels, int node, int depth, int& lo, int& hi) {
+    lo = hi = node;
+    for (int d = depth; d < levels - 1; d++) {
+        lo = lo * arity + 1;
+        hi = hi * arity + arity;
+    }
+}
+
+/**
+ * Unlock notification with a given number of background subscriptions
+ *
+ * Background subscriptions wait on leaves under node 1, which stays locked
+ * until the final mass wake-up. Measures:
+ * - unlock cost on an unrelated subtree (node 2), which must not pay for
+ *   subscriptions it cannot clear
+ * - latency from unlock() to a scheduler thread blocked in poll() on the
+ *   eventfd having the event in hand
+ * - unlocking node 1, which wakes every background subscription at once
+ */
+void runNotify(int subscriptions) {
+    const int arity = 10;
+    const int levels = 6;
+    const int rounds = 20;
+    const int probes = 2000;
+
+    NaryTreeLock tree;
+    buildKaryTree(tree, arity, levels);
+
+    UnlockNotifier notifier(1 << 18);
+    tree.setUnlockNotifier(&notifier);
+
+    int blocked_lo, blocked_hi, free_lo, free_hi;
+    leafRange(arity, levels, 1, 1, blocked_lo, blocked_hi);
+    leafRange(arity, levels, 2, 1, free_lo, free_hi);
+
+    tree.lock(1, 1);
+    int span = blocked_hi - blocked_lo + 1;
+    for (int i = 0; i < subscriptions; i++) {
+        tree.subscribeUnlock(blocked_lo + i % span);
+    }
+
+    // Unlock cost on the unrelated subtree
+    double lock_seconds = 0.0;
+    double unlock_seconds = 0.0;
+    for (int round = 0; round < rounds; round++) {
+        auto start = chrono::steady_clock::now();
+        for (int leaf = free_lo; leaf <= free_hi; leaf++) {
+            tree.lock(leaf, 2);
+        }
+        auto middle = chrono::steady_clock::now();
+        for (int leaf = free_lo; leaf <= free_hi; leaf++) {
+            tree.unlock(leaf, 2);
+        }
+        auto end = chrono::steady_clock::now();
+        lock_seconds += chrono::duration<double>(middle - start).count();
+        unlock_seconds += chrono::duration<double>(end - middle).count();
+    }
+    double leaf_ops = static_cast<double>(rounds) * (free_hi - free_lo + 1);
+
+    // Scheduler thread: block on the eventfd, drain, match events
+    atomic<uint64_t> probe_id(0);
+    atomic<uint64_t> probe_start(0);
+    atomic<bool> probe_seen(false);
+    atomic<long long> background_seen(0);
+    atomic<long long> stray(0);
+    atomic<bool> stop(false);
+    LatencyHistogram latency;
+
+    auto scheduler_func = [&]() {
+        vector<UnlockEvent> events;
+        while (!stop.load()) {
+            if (!notifier.wait(100)) continue;
+            events.clear();
+            notifier.drain(events);
+            uint64_t received = UnlockNotifier::now();
+
+            for (const UnlockEvent& event : events) {
+                if (event.subscription_id == probe_id.load()) {
+                    latency.record(received - probe_start.load());
+                    probe_seen = true;
+                } else if (event.node_id >= blocked_lo && event.node_id <= blocked_hi) {
+                    background_seen++;
+                } else {
+                    stray++;
+                }
+            }
+        }
+    };
+    thread scheduler(scheduler_func);
+
+    // Probe: a leaf parent under node 2 waiting for its one locked child
+    int leaf = free_lo;
+    int probe_node = (leaf - 1) / arity;
+    for (int i = 0; i < probes; i++) {
+        tree.lock(leaf, 2);
+        probe_id = tree.subscribeUnlock(probe_node);
+        probe_start = UnlockNotifier::now();
+        tree.unlock(leaf, 2);
+
+        while (!probe_seen.load()) {
+            this_thread::yield();
+        }
+        probe_seen = false;
+    }
+
+    // Mass wake-up: releasing node 1 clears every background subscription
+    auto wake_start = chrono::steady_clock::now();
+    tree.unlock(1, 1);
+    auto wake_unlocked = chrono::steady_clock::now();
+    while (background_seen.load() < subscriptions &&
+           chrono::steady_clock::now() - wake_start < chrono::seconds(10)) {
+        this_thread::yield();
+    }
+    auto wake_end = chrono::steady_clock::now();
+
+    stop = true;
+    scheduler.join();
+
+    cout << fixed << setprecision(1);
+    cout << subscriptions << " subscriptions" << endl;
+    cout << "  Unrelated lock / unlock:      " << lock_seconds * 1e9 / leaf_ops << " / "
+         << unlock_seconds * 1e9 / leaf_ops << " ns" << endl;
+    cout << "  Notify latency mean/p50/p99:  " << latency.mean() / 1000.0 << " / "
+         << latency.percentile(50) / 1000.0 << " / " << latency.percentile(99) / 1000.0
+         << " us (" << latency.count() << " probes)" << endl;
+    cout << "  Mass wake unlock() / all:     "
+         << chrono::duration<double>(wake_unlocked - wake_start).count() * 1000.0 << " / "
+         << chrono::duration<double>(wake_end - wake_start).count() * 1000.0 << " ms ("
+         << background_seen << " woken)" << endl;
+
+    bool exact = stray == 0 && background_seen == subscriptions && notifier.droppedEvents() == 0;
+    cout << "  " << (exact ? GREEN "[OK] " : RED "[BROKEN] ") << RESET
+         << "Only cleared subscriptions woken" << endl;
+    if (!exact) {
+        bench_failed = true;
+    }
+}
+
+/**
+ * Scenario: unlock notification cost with 0, 1k and 100k subscriptions
+ */
+void benchNotify() {
+    printBenchHeader("Unlock notification: 111111-node 10-ary tree");
+
+    runNotify(0);
+    runNotify(1000);
+    runNotify(100000);
+}
+
+/**
+ * Bytes currently allocated on the heap (0 where glibc's mallinfo2 is not
+ * available)
+ */
+size_t heapInUse() {
+#ifdef __GLIBC__
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Lock/unlock random (tenant, node) pairs from several threads
+ * @return elapsed seconds
+ */
+template <typename LockFn, typename UnlockFn>
+double runTenantWorkload(const vector<vector<int>>& shapes, LockFn lock_fn, UnlockFn unlock_fn) {
+    const int thread_count = 4;
+    const int iterations = 200000;
+
+    auto worker = [&](int t) {
+        unsigned int seed = 7919u * (t + 1);
+        for (int i = 0; i < iterations; i++) {
+            seed = seed * 1103515245u + 12345u;
+            int tenant = (seed >> 8) % shapes.size();
+            int node = (seed >> 4) % shapes[tenant].size();
+            if (lock_fn(tenant, node, t + 1)) {
+                unlock_fn(tenant, node, t + 1);
+            }
+        }
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+        threads.push_back(thread(worker, t));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Scenario: many small tenant trees, one NaryTreeLock each vs one forest
+ *
+ * 20000 random trees of 8..40 nodes. Reports memory per tenant, tenant
+ * creation / deletion cost and lock throughput over random tenants.
+ */
+void benchForest() {
+    const int tenants = 20000;
+
+    vector<vector<int>> shapes(tenants);
+    size_t total_nodes = 0;
+    unsigned int seed = 4242u;
+    for (int t = 0; t < tenants; t++) {
+        seed = seed * 1103515245u + 12345u;
+        int size = 8 + (seed >> 8) % 33;
+        shapes[t].push_back(-1);
+        for (int i = 1; i < size; i++) {
+            seed = seed * 1103515245u + 12345u;
+            shapes[t].push_back((seed >> 8) % i);
+        }
+        total_nodes += size;
+    }
+    double mean_nodes = static_cast<double>(total_nodes) / tenants;
+
+    printBenchHeader("Forest: 20000 tenant trees, 8..40 nodes each");
+
+    vector<vector<string>> names(tenants);
+    for (int t = 0; t < tenants; t++) {
+        for (size_t i = 0; i < shapes[t].size(); i++) {
+            names[t].push_back("Node_" + to_string(i));
+        }
+    }
+
+    // One NaryTreeLock per tenant
+    size_t heap_before = heapInUse();
+    auto start = chrono::steady_clock::now();
+    vector<unique_ptr<NaryTreeLock>> trees;
+    for (int t = 0; t < tenants; t++) {
+        trees.push_back(unique_ptr<NaryTreeLock>(new NaryTreeLock()));
+        trees.back()->buildTree(names[t], shapes[t]);
+    }
+    double tree_create = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t tree_heap = heapInUse() - heap_before;
+
+    double tree_ops = runTenantWorkload(shapes,
+        [&](int tenant, int node, int user) { return trees[tenant]->lock(node, user); },
+        [&](int tenant, int node, int user) { return trees[tenant]->unlock(node, user); });
+
+    start = chrono::steady_clock::now();
+    trees.clear();
+    double tree_destroy = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // One forest for all tenants
+    NaryForest forest;
+    vector<NaryForest::TreeId> ids;
+    ids.reserve(tenants);
+    start = chrono::steady_clock::now();
+    for (int t = 0; t < tenants; t++) {
+        ids.push_back(forest.createTree(shapes[t]));
+    }
+    double forest_create = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    ForestMemory memory = forest.memoryUsage();
+
+    double forest_ops = runTenantWorkload(shapes,
+        [&](int tenant, int node, int user) { return forest.lock(ids[tenant], node, user); },
+        [&](int tenant, int node, int user) { return forest.unlock(ids[tenant], node, user); });
+
+    start = chrono::steady_clock::now();
+    for (int t = 0; t < tenants; t++) {
+        forest.destroyTree(ids[t]);
+    }
+    double forest_destroy = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // Recreate from the free lists, then drop everything at once
+    start = chrono::steady_clock::now();
+    for (int t = 0; t < tenants; t++) {
+        ids[t] = forest.createTree(shapes[t]);
+    }
+    double forest_recreate = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    start = chrono::steady_clock::now();
+    forest.clear();
+    double forest_clear = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    double forest_bytes = static_cast<double>(memory.allocated + memory.table) / tenants;
+    double overhead = static_cast<double>(memory.allocated - memory.payload + memory.table) / tenants;
+    double operations = 4.0 * 200000;
+
+    cout << fixed << setprecision(1);
+    cout << "Mean tree size:                " << mean_nodes << " nodes" << endl;
+    cout << "NaryTreeLock per tenant:       " << static_cast<double>(tree_heap) / tenants
+         << " bytes (" << static_cast<double>(tree_heap) / total_nodes << " per node)" << endl;
+    cout << "Forest per tenant:             " << forest_bytes << " bytes ("
+         << static_cast<double>(memory.payload) / total_nodes << " per node + "
+         << overhead << " per-tree overhead)" << endl;
+    cout << "Forest arena reserved:         " << memory.reserved / 1024 << " KiB" << endl;
+    cout << setprecision(3);
+    cout << "Create per tenant (tree/forest/reuse): " << tree_create * 1e6 / tenants << " / "
+         << forest_create * 1e6 / tenants << " / " << forest_recreate * 1e6 / tenants << " us" << endl;
+    cout << "Destroy per tenant (tree/forest):      " << tree_destroy * 1e6 / tenants << " / "
+         << forest_destroy * 1e6 / tenants << " us; clear() all: " << forest_clear * 1e3 << " ms" << endl;
+    cout << setprecision(2);
+    cout << "Lock+unlock throughput (tree/forest):  " << operations / tree_ops / 1e6 << " / "
+         << operations / forest_ops / 1e6 << " M pairs/s" << endl;
+}
+
+/**
+ * Upgrade under sibling churn
+ *
+ * Root -> Parent (1) -> 64 leaves. User 1 holds leaves 2..5 and upgrades
+ * Parent, 200 times; three other users lock and unlock the remaining
+ * leaves, holding each lock across a yield (like the sleep in
+ * testMultithreading).
+ * @param mode: 0 = no upgrader, 1 = upgradeLock() retried until it
+ *              succeeds, 2 = upgradeLockQueued()
+ */
+void runUpgradeChurn(int mode, const string& label) {
+    const int leaves = 64;
+    const int own_leaves = 4;
+    const int churners = 3;
+    const int rounds = 200;
+    const auto give_up = chrono::milliseconds(20);
+
+    vector<string> names = {"Root", "Parent"};
+    vector<int> parents = {-1, 0};
+    for (int i = 0; i < leaves; i++) {
+        names.push_back("Leaf_" + to_string(i));
+        parents.push_back(1);
+    }
+
+    NaryTreeLock tree;
+    tree.buildTree(names, parents);
+
+    atomic<bool> done(false);
+    vector<long long> churn_pairs(churners, 0);
+    vector<long long> churn_rejected(churners, 0);
+
+    auto churn_func = [&](int index) {
+        int user_id = index + 2;
+        unsigned int seed = 31337u * (index + 1);
+        while (!done.load()) {
+            seed = seed * 1103515245u + 12345u;
+            int leaf = 2 + own_leaves + (seed >> 8) % (leaves - own_leaves);
+            if (tree.lock(leaf, user_id)) {
+                this_thread::yield();
+                tree.unlock(leaf, user_id);
+                churn_pairs[index]++;
+            } else {
+                churn_rejected[index]++;
+                this_thread::yield();
+            }
+        }
+    };
+
+    LatencyHistogram latency;
+    int succeeded = 0;
+    long long attempts = 0;
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int t = 0; t < churners; t++) {
+        threads.push_back(thread(churn_func, t));
+    }
+
+    for (int round = 0; round < rounds; round++) {
+        if (mode == 0) {
+            this_thread::sleep_for(chrono::microseconds(500));
+            continue;
+        }
+
+        for (int leaf = 2; leaf < 2 + own_leaves; leaf++) {
+            while (!tree.lock(leaf, 1)) {
+                this_thread::yield();
+            }
+        }
+
+        auto upgrade_start = chrono::steady_clock::now();
+        bool ok = false;
+        if (mode == 1) {
+            while (!ok && chrono::steady_clock::now() - upgrade_start < give_up) {
+                attempts++;
+                ok = tree.upgradeLock(1, 1);
+                if (!ok) this_thread::yield();
+            }
+        } else {
+            attempts++;
+            ok = tree.upgradeLockQueued(1, 1, give_up);
+        }
+        auto upgrade_end = chrono::steady_clock::now();
+
+        if (ok) {
+            succeeded++;
+            latency.record(chrono::duration_cast<chrono::nanoseconds>(upgrade_end - upgrade_start).count());
+            tree.unlock(1, 1);
+        } else {
+            for (int leaf = 2; leaf < 2 + own_leaves; leaf++) {
+                tree.unlock(leaf, 1);
+            }
+        }
+        this_thread::sleep_for(chrono::microseconds(500));
+    }
+
+    done = true;
+    for (auto& t : threads) {
+        t.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    long long pairs = 0;
+    long long rejected = 0;
+    for (int t = 0; t < churners; t++) {
+        pairs += churn_pairs[t];
+        rejected += churn_rejected[t];
+    }
+
+    cout << fixed << setprecision(2);
+    cout << label << endl;
+    if (mode != 0) {
+        cout << "  Upgrades succeeded:        " << succeeded << " / " << rounds
+             << " (" << attempts << " calls)" << endl;
+        cout << "  Upgrade latency p50/p99:   " << latency.percentile(50) / 1000.0 << " / "
+             << latency.percentile(99) / 1000.0 << " us" << endl;
+    }
+    cout << "  Churn lock+unlock pairs:   " << pairs / seconds / 1e3 << " K/s ("
+         << rejected << " locks rejected)" << endl;
+
+    bool clear = treeIsClear(tree, static_cast<int>(names.size()));
+    cout << "  " << (clear ? GREEN "[OK] " : RED "[BROKEN] ") << RESET
+         << "Counters cleared after run" << endl;
+    if (!clear) {
+        bench_failed = true;
+    }
+}
+
+/**
+ * Scenario: queued vs retried upgradeLock under sibling churn
+ */
+void benchUpgrade() {
+    printBenchHeader("Upgrade under churn: 3 churn users on 60 sibling leaves");
+
+    runUpgradeChurn(0, "Churn only");
+    runUpgradeChurn(1, "upgradeLock() retried for up to 20 ms");
+    runUpgradeChurn(2, "upgradeLockQueued() with 20 ms timeout");
+}
+
+/**
+ * Short-lived locks on nearby nodes, issued directly or through a
+ * LockBatch per thread. Each round a thread picks a random leaf parent of
+ * a 5461-node 4-ary tree and works on its 4 leaves:
+ * - sets:   lock all 4, then unlock all 4 (two flushes when batched)
+ * - probes: lock and immediately unlock each leaf (one flush)
+ */
+void runBatchWorkload(bool probes, bool batched, const string& label) {
+    const int arity = 4;
+    const int levels = 7;
+    const int num_threads = 8;
+    const int rounds = 20000;
+    int node_count = countNodes(arity, levels);
+    int first_parent = countNodes(arity, levels - 2);
+    int parent_count = countNodes(arity, levels - 1) - first_parent;
+
+    NaryTreeLock tree;
+    buildKaryTree(tree, arity, levels);
+
+    vector<LockStats> stats(num_threads);
+    vector<long long> granted(num_threads, 0);
+
+    auto worker = [&](int index) {
+        NaryTreeLock::threadStats() = LockStats();
+        LockBatch batch(tree);
+        vector<bool> results;
+        unsigned int seed = 1234u + index;
+
+        for (int round = 0; round < rounds; round++) {
+            seed = seed * 1103515245u + 12345u;
+            int first_leaf = (first_parent + (seed >> 8) % parent_count) * arity + 1;
+
+            if (!batched) {
+                for (int leaf = first_leaf; leaf < first_leaf + arity; leaf++) {
+                    if (probes) {
+                        granted[index] += tree.lock(leaf, index) && tree.unlock(leaf, index);
+                        continue;
+                    }
+                    granted[index] += tree.lock(leaf, index);
+                }
+                if (!probes) {
+                    for (int leaf = first_leaf; leaf < first_leaf + arity; leaf++) {
+                        tree.unlock(leaf, index);
+                    }
+                }
+                continue;
+            }
+
+            for (int leaf = first_leaf; leaf < first_leaf + arity; leaf++) {
+                batch.lock(leaf, index);
+                if (probes) batch.unlock(leaf, index);
+            }
+            size_t succeeded = batch.flush(results);
+            if (probes) {
+                granted[index] += succeeded / 2;
+                continue;
+            }
+            granted[index] += succeeded;
+
+            for (int leaf = first_leaf; leaf < first_leaf + arity; leaf++) {
+                batch.unlock(leaf, index);
+            }
+            batch.flush(results);
+        }
+
+        stats[index] = NaryTreeLock::threadStats();
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.push_back(thread(worker, t));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto end = chrono::steady_clock::now();
+
+    LockStats total;
+    long long locks = 0;
+    for (int t = 0; t < num_threads; t++) {
+        total.ancestor_rmws += stats[t].ancestor_rmws;
+        total.cas_retries += stats[t].cas_retries;
+        locks += granted[t];
+    }
+
+    double operations = 2.0 * num_threads * rounds * arity;
+    double seconds = chrono::duration<double>(end - start).count();
+
+    cout << fixed << setprecision(2);
+    cout << label << endl;
+    cout << "  Ancestor RMWs per call:    " << total.ancestor_rmws / operations << endl;
+    cout << "  Throughput:                " << operations / seconds / 1e6 << " M calls/s" << endl;
+    cout << "  Locks granted:             " << locks << " / " << static_cast<long long>(operations / 2)
+         << " (" << total.cas_retries << " CAS retries)" << endl;
+
+    bool clear = treeIsClear(tree, node_count);
+    cout << "  " << (clear ? GREEN "[OK] " : RED "[BROKEN] ") << RESET
+         << "Counters cleared after run" << endl;
+    if (!clear) {
+        bench_failed = true;
+    }
+}
+
+/**
+ * Scenario: batched submission vs direct calls
+ */
+void benchBatch() {
+    printBenchHeader("Batched submission: 8 threads, 4 sibling leaves per round");
+
+    runBatchWorkload(false, false, "Lock sets, direct calls");
+    runBatchWorkload(false, true, "Lock sets, LockBatch");
+    runBatchWorkload(true, false, "Lock/unlock probes, direct calls");
+    runBatchWorkload(true, true, "Lock/unlock probes, LockBatch");
+}
+
+struct Scenario {
+    const char* name;
+    void (*run)();
+};
+
+int main(int argc, char** argv) {
+    const Scenario scenarios[] = {
+        {"stress", benchStress},
+        {"trace", benchTrace},
+        {"escalation", benchEscalation},
+        {"notify", benchNotify},
+        {"forest", benchForest},
+        {"upgrade", benchUpgrade},
+        {"batch", benchBatch},
+    };
+
+    cout << YELLOW << "\n"
+         << "================================================\n"
+         << "  N-ary Tree Locking Algorithm Benchmarks\n"
+         << "================================================\n"
+         << RESET << endl;
+
+    string selected = argc > 1 ? argv[1] : "";
+    if (selected == "trace" && argc > 2) {
+        trace_path = argv[2];
+    }
+    bool ran = false;
+
+    for (const Scenario& scenario : scenarios) {
+        if (selected.empty() || selected == scenario.name) {
+            scenario.run();
+            ran = true;
+        }
+    }
+
+    if (!ran) {
+        cout << RED << "Unknown scenario: " << selected << RESET << endl;
+        return 1;
+    }
+
+    return bench_failed ? 1 : 0;
+}
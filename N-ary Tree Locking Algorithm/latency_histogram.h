@@ -0,0 +1,77 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+/**
+ * Log2-bucketed latency histogram (nanoseconds)
+ *
+ * Bucket i holds samples in [2^i, 2^(i+1)) ns, bucket 0 also holds 0.
+ * Not thread-safe: keep one per thread and merge() after joining.
+ */
+class LatencyHistogram {
+private:
+    std::array<uint64_t, 64> buckets{};
+    uint64_t samples = 0;
+    uint64_t total_ns = 0;
+
+    static int bucketOf(uint64_t ns) {
+        int bucket = 0;
+        while (ns > 1) {
+            ns >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+public:
+    void record(uint64_t ns) {
+        buckets[bucketOf(ns)]++;
+        samples++;
+        total_ns += ns;
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < buckets.size(); i++) {
+            buckets[i] += other.buckets[i];
+        }
+        samples += other.samples;
+        total_ns += other.total_ns;
+    }
+
+    uint64_t count() const { return samples; }
+
+    double mean() const { return samples ? static_cast<double>(total_ns) / samples : 0.0; }
+
+    // Upper bound (ns) of the bucket containing the given percentile (0..100)
+    uint64_t percentile(double p) const {
+        uint64_t rank = static_cast<uint64_t>(samples * p / 100.0);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets.size(); i++) {
+            seen += buckets[i];
+            if (seen > rank) {
+                return 2ull << i;
+            }
+        }
+        return 0;
+    }
+
+    void print(std::ostream& os, const std::string& label) const {
+        os << label << ": " << samples << " samples, mean "
+           << std::fixed << std::setprecision(0) << mean() << " ns, p50 < "
+           << percentile(50) << " ns, p99 < " << percentile(99) << " ns, p99.9 < "
+           << percentile(99.9) << " ns" << std::endl;
+
+        for (size_t i = 0; i < buckets.size(); i++) {
+            if (buckets[i] == 0) continue;
+            os << "  [" << std::setw(10) << (i == 0 ? 0 : 1ull << i) << ", "
+               << std::setw(10) << (2ull << i) << ") ns  " << buckets[i] << std::endl;
+        }
+    }
+};
+
+#endif // LATENCY_HISTOGRAM_H
@@ -0,0 +1,405 @@
+#include "lock_batch.h"
+#include <algorithm>
+
+// LockBatch::DeltaTable Implementation
+LockBatch::DeltaTable::DeltaTable() : keys(64, nullptr), values(64), mask(63) {}
+
+size_t LockBatch::DeltaTable::slotOf(TreeNode* node) const {
+    uint64_t hash = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(node)) * 0x9E3779B97F4A7C15ull;
+    return static_cast<size_t>(hash >> 32) & mask;
+}
+
+void LockBatch::DeltaTable::grow() {
+    std::vector<std::pair<TreeNode*, NodeDelta>> entries;
+    for (uint32_t slot : used) {
+        entries.push_back({keys[slot], values[slot]});
+    }
+
+    keys.assign(keys.size() * 2, nullptr);
+    values.assign(keys.size(), NodeDelta());
+    mask = keys.size() - 1;
+    used.clear();
+
+    for (auto& entry : entries) {
+        (*this)[entry.first] = entry.second;
+    }
+}
+
+LockBatch::NodeDelta& LockBatch::DeltaTable::operator[](TreeNode* node) {
+    // Keep the load factor at or below one half
+    if ((used.size() + 1) * 2 > keys.size()) {
+        grow();
+    }
+
+    size_t slot = slotOf(node);
+    while (keys[slot] != nullptr && keys[slot] != node) {
+        slot = (slot + 1) & mask;
+    }
+
+    if (keys[slot] == nullptr) {
+        keys[slot] = node;
+        values[slot] = NodeDelta();
+        used.push_back(static_cast<uint32_t>(slot));
+    }
+    return values[slot];
+}
+
+LockBatch::NodeDelta* LockBatch::DeltaTable::find(TreeNode* node) {
+    size_t slot = slotOf(node);
+    while (keys[slot] != nullptr) {
+        if (keys[slot] == node) {
+            return &values[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+    return nullptr;
+}
+
+void LockBatch::DeltaTable::clear() {
+    for (uint32_t slot : used) {
+        keys[slot] = nullptr;
+    }
+    used.clear();
+}
+
+// LockBatch Implementation
+LockBatch::LockBatch(NaryTreeLock& lock_tree) : tree(lock_tree) {}
+
+void LockBatch::lock(int node_id, int user_id) {
+    ops.push_back({OpKind::Lock, node_id, user_id});
+}
+
+void LockBatch::unlock(int node_id, int user_id) {
+    ops.push_back({OpKind::Unlock, node_id, user_id});
+}
+
+void LockBatch::upgradeLock(int node_id, int user_id) {
+    ops.push_back({OpKind::UpgradeLock, node_id, user_id});
+}
+
+/**
+ * Submit queued calls
+ *
+ * Algorithm:
+ * 1. lock(X) directly followed by unlock(X): decide both from a snapshot
+ * 2. Run of locks: pin all their ancestors with one fetch_add per distinct
+ *    ancestor, take the nodes in order, re-check the ancestors once
+ * 3. Run of unlocks: release the nodes in order, then one fetch_sub per
+ *    distinct ancestor
+ * 4. upgradeLock: direct call
+ *
+ * Every run applies its counter changes before the next one starts, so a
+ * later call sees the counts left by earlier ones exactly as with direct
+ * calls.
+ */
+size_t LockBatch::flush(std::vector<bool>& results) {
+    results.assign(ops.size(), false);
+
+    const EscalationPolicy& policy = tree.escalation_policy;
+    bool direct = tree.trace_recorder != nullptr || policy.max_locked_descendants > 0 ||
+                  policy.max_child_fraction > 0.0;
+
+    size_t i = 0;
+    while (i < ops.size()) {
+        const Op& op = ops[i];
+
+        if (direct) {
+            results[i] = runDirect(op);
+            i++;
+            continue;
+        }
+
+        if (isCancellingPair(i)) {
+            TreeNode* node = tree.getNode(op.node_id);
+            if (node && lockableSnapshot(node)) {
+                NARY_STAT(lock_attempts);
+                results[i] = true;
+                results[i + 1] = true;
+                i += 2;
+                continue;
+            }
+            // Not lockable (maybe already ours): run both calls normally
+        }
+
+        switch (op.kind) {
+            case OpKind::Lock:
+                i = runLocks(i, results);
+                break;
+            case OpKind::Unlock:
+                i = runUnlocks(i, results);
+                break;
+            case OpKind::UpgradeLock:
+                results[i] = tree.upgradeLockImpl(op.node_id, op.user_id);
+                i++;
+                break;
+        }
+    }
+
+    ops.clear();
+    return std::count(results.begin(), results.end(), true);
+}
+
+bool LockBatch::runDirect(const Op& op) {
+    switch (op.kind) {
+        case OpKind::Lock:
+            return tree.lock(op.node_id, op.user_id);
+        case OpKind::Unlock:
+            return tree.unlock(op.node_id, op.user_id);
+        case OpKind::UpgradeLock:
+            return tree.upgradeLock(op.node_id, op.user_id);
+    }
+    return false;
+}
+
+bool LockBatch::isCancellingPair(size_t index) const {
+    if (index + 1 >= ops.size()) return false;
+
+    const Op& first = ops[index];
+    const Op& second = ops[index + 1];
+    return first.kind == OpKind::Lock && second.kind == OpKind::Unlock &&
+           first.node_id == second.node_id && first.user_id == second.user_id &&
+           first.user_id != -1;
+}
+
+/**
+ * Check that lock(node) would succeed, without writing anything
+ * Time Complexity: O(log N) - two passes over the ancestors
+ *
+ * Double collect: every ancestor is read unlocked twice with the same
+ * full word, so none of them was locked in between. The node itself is
+ * read in between, unlocked with no locked descendant. At that instant a
+ * lock would have succeeded, and the matching unlock right after it, so
+ * the pair takes effect there.
+ *
+ * Best effort: the version is 4 bits, so an ancestor locked and unlocked
+ * eight times between the two reads, with its count back where it was,
+ * looks unchanged. Comparing whole words (not just owner and version)
+ * makes that need a quiet subtree as well as 16 owner changes within a
+ * few loads.
+ */
+bool LockBatch::lockableSnapshot(TreeNode* node) {
+    snapshot.clear();
+
+    for (TreeNode* curr = node->parent; curr != nullptr; curr = curr->parent) {
+        uint64_t state = curr->state.load();
+        if (NodeState::isLocked(state)) {
+            return false;
+        }
+        snapshot.push_back(state);
+    }
+
+    uint64_t observed = node->state.load();
+    if (NodeState::isLocked(observed) || NodeState::descendantCount(observed) > 0) {
+        return false;
+    }
+
+    size_t index = 0;
+    for (TreeNode* curr = node->parent; curr != nullptr; curr = curr->parent) {
+        if (curr->state.load() != snapshot[index++]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * True if node is, or is an ancestor or descendant of, a lock already in
+ * the run. Pinning them together would let the earlier lock see counts
+ * of the later one, so such a lock starts a new run.
+ */
+bool LockBatch::relatedToRun(TreeNode* node) {
+    if (pins.find(node)) {
+        return true;
+    }
+
+    for (TreeNode* curr = node->parent; curr != nullptr; curr = curr->parent) {
+        NodeDelta* delta = pins.find(curr);
+        if (delta) {
+            // Above a shared ancestor there are only further shared ancestors
+            return delta->member;
+        }
+    }
+
+    return false;
+}
+
+bool LockBatch::hasBlockedAncestor(TreeNode* node) {
+    for (TreeNode* curr = node->parent; curr != nullptr; curr = curr->parent) {
+        if (pins.find(curr)->blocked) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Acquire the node: unlocked and no locked descendant, as one CAS
+bool LockBatch::takeNode(TreeNode* node, int user_id) {
+    uint64_t observed = node->state.load();
+
+    while (true) {
+        if (NodeState::isLocked(observed) || NodeState::descendantCount(observed) > 0) {
+            return false;
+        }
+        if (node->state.compare_exchange_weak(observed, NodeState::withOwner(observed, user_id))) {
+            return true;
+        }
+        NARY_STAT(cas_retries);
+    }
+}
+
+void LockBatch::addRelease(TreeNode* node) {
+    for (TreeNode* curr = node->parent; curr != nullptr; curr = curr->parent) {
+        NodeDelta& delta = releases[curr];
+        delta.count++;
+        delta.released_id = node->id;
+    }
+}
+
+/**
+ * Drop the owed counts, one fetch_sub per ancestor, then release drained
+ * escalations and wake subscribers as updateAncestorCount and unlock() would
+ */
+void LockBatch::applyReleases() {
+    for (size_t index = 0; index < releases.size(); index++) {
+        TreeNode* curr = releases.keyAt(index);
+        const NodeDelta& delta = releases.valueAt(index);
+        uint64_t amount = static_cast<uint64_t>(delta.count) << NodeState::kCountShift;
+        uint64_t prev = curr->state.fetch_sub(amount);
+        NARY_STAT(ancestor_rmws);
+
+        if (NodeState::descendantCount(prev - amount) == 0) {
+            if (NodeState::isEscalated(prev)) {
+                tree.releaseIfDrained(curr);
+            } else if (curr->subscriber_count.load() > 0 && tree.isLockable(curr)) {
+                tree.fireSubscriptions(curr, delta.released_id);
+            }
+        }
+    }
+    releases.clear();
+
+    for (TreeNode* node : released_nodes) {
+        tree.notifyReleased(node);
+    }
+    released_nodes.clear();
+}
+
+/**
+ * Run consecutive locks from begin with shared ancestor pins
+ * @return index of the first call not handled
+ */
+size_t LockBatch::runLocks(size_t begin, std::vector<bool>& results) {
+    pins.clear();
+    candidates.clear();
+
+    // 1. Pre-check each lock as lock() does and sum the pins it needs
+    size_t i = begin;
+    for (; i < ops.size() && ops[i].kind == OpKind::Lock; i++) {
+        if (i > begin && isCancellingPair(i)) break;
+
+        const Op& op = ops[i];
+        TreeNode* node = tree.getNode(op.node_id);
+        if (!node || op.user_id == -1) continue;
+
+        if (relatedToRun(node)) break;
+
+        NARY_STAT(lock_attempts);
+
+        uint64_t observed = node->state.load();
+        if (NodeState::isLocked(observed) || NodeState::descendantCount(observed) > 0 ||
+            tree.hasLockedAncestor(node)) {
+            continue;
+        }
+
+        pins[node].member = true;
+        for (TreeNode* curr = node->parent; curr != nullptr; curr = curr->parent) {
+            pins[curr].count++;
+        }
+        candidates.push_back({i, node});
+    }
+
+    // 2. Pin every distinct ancestor once; a locked one fails the locks under it
+    bool blocked = false;
+    for (size_t index = 0; index < pins.size(); index++) {
+        NodeDelta& delta = pins.valueAt(index);
+        if (delta.count == 0) continue;
+
+        uint64_t amount = static_cast<uint64_t>(delta.count) << NodeState::kCountShift;
+        uint64_t prev = pins.keyAt(index)->state.fetch_add(amount);
+        NARY_STAT(ancestor_rmws);
+
+        if (NodeState::isLocked(prev)) {
+            delta.blocked = true;
+            blocked = true;
+        }
+    }
+
+    // 3. Take the nodes in queue order
+    for (auto& candidate : candidates) {
+        TreeNode* node = candidate.second;
+        if ((blocked && hasBlockedAncestor(node)) || !takeNode(node, ops[candidate.first].user_id)) {
+            addRelease(node);
+            NARY_STAT(rollbacks);
+            continue;
+        }
+        results[candidate.first] = true;
+    }
+
+    // 4. Re-check each pinned ancestor once (validateAncestors for the run)
+    bool invalid = false;
+    for (size_t index = 0; index < pins.size(); index++) {
+        NodeDelta& delta = pins.valueAt(index);
+        if (delta.count > 0 && !delta.blocked && NodeState::isLocked(pins.keyAt(index)->state.load())) {
+            delta.blocked = true;
+            invalid = true;
+        }
+    }
+
+    if (invalid) {
+        for (auto& candidate : candidates) {
+            TreeNode* node = candidate.second;
+            if (!results[candidate.first] || !hasBlockedAncestor(node)) continue;
+
+            // Skip the release if the user unlocked the node concurrently
+            if (tree.releaseOwner(node, ops[candidate.first].user_id)) {
+                addRelease(node);
+                released_nodes.push_back(node);
+            }
+            results[candidate.first] = false;
+            NARY_STAT(rollbacks);
+        }
+    }
+
+    applyReleases();
+    return i;
+}
+
+/**
+ * Run consecutive unlocks from begin with shared ancestor releases
+ * @return index of the first call not handled
+ */
+size_t LockBatch::runUnlocks(size_t begin, std::vector<bool>& results) {
+    size_t i = begin;
+    for (; i < ops.size() && ops[i].kind == OpKind::Unlock; i++) {
+        const Op& op = ops[i];
+        TreeNode* node = tree.getNode(op.node_id);
+        if (!node || op.user_id == -1) continue;
+
+        uint64_t released;
+        if (!tree.releaseOwner(node, op.user_id, &released)) continue;
+        results[i] = true;
+
+        if (NodeState::isShadow(released)) {
+            // Counted only up to its escalated ancestor, which may drain
+            tree.releaseAncestors(node, tree.escalationBoundary(node));
+            tree.notifyReleased(node);
+            continue;
+        }
+
+        addRelease(node);
+        released_nodes.push_back(node);
+    }
+
+    applyReleases();
+    return i;
+}
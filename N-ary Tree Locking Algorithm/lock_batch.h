@@ -0,0 +1,130 @@
+#ifndef LOCK_BATCH_H
+#define LOCK_BATCH_H
+
+#include "nary_tree_lock.h"
+#include <vector>
+#include <cstdint>
+#include <utility>
+
+/**
+ * Batched Lock Submission
+ *
+ * A thread queues lock / unlock / upgradeLock calls on a LockBatch and
+ * submits them together with flush(). Every call gets the result it
+ * would have had as a direct call at some point during the flush, in
+ * queue order, but ancestor counter updates are shared:
+ *
+ * - A run of consecutive locks on unrelated nodes (none an ancestor of
+ *   another) pins each common ancestor once, with the summed count, and
+ *   validates it once
+ * - A run of consecutive unlocks releases each common ancestor once
+ * - lock(X) immediately followed by unlock(X) for the same user touches
+ *   no counter at all: if X is lockable in a consistent snapshot of X and
+ *   its ancestors, both calls succeed; otherwise both are run normally
+ *
+ * Without sharing, every lock and unlock walks to the root with one atomic
+ * RMW per ancestor, so k locks under one parent cost k RMWs on every
+ * common ancestor instead of one.
+ *
+ * With an escalation policy or a trace recorder set, flush() makes direct
+ * calls instead, so escalation and traces see every operation.
+ *
+ * A LockBatch belongs to one thread; use one per thread on a shared tree.
+ */
+
+class LockBatch {
+private:
+    enum class OpKind : uint8_t {
+        Lock,
+        Unlock,
+        UpgradeLock
+    };
+
+    struct Op {
+        OpKind kind;
+        int node_id;
+        int user_id;
+    };
+
+    // Per-node bookkeeping for one run
+    struct NodeDelta {
+        int count = 0;          // Pins taken, or releases owed
+        int released_id = -1;   // Last released node counted here
+        bool member = false;    // Node is locked by this run
+        bool blocked = false;   // Found locked while pinned
+    };
+
+    /**
+     * Open-addressing map from node to NodeDelta. clear() only resets the
+     * slots in use, so once grown a run costs no allocation.
+     */
+    class DeltaTable {
+    private:
+        std::vector<TreeNode*> keys;
+        std::vector<NodeDelta> values;
+        std::vector<uint32_t> used;  // Occupied slots in insertion order
+        size_t mask;
+
+        size_t slotOf(TreeNode* node) const;
+        void grow();
+
+    public:
+        DeltaTable();
+
+        NodeDelta& operator[](TreeNode* node);  // Adds a zero entry if missing
+        NodeDelta* find(TreeNode* node);
+        void clear();
+
+        // Entries in insertion order
+        size_t size() const { return used.size(); }
+        TreeNode* keyAt(size_t index) const { return keys[used[index]]; }
+        NodeDelta& valueAt(size_t index) { return values[used[index]]; }
+    };
+
+    NaryTreeLock& tree;
+    std::vector<Op> ops;
+
+    // Scratch, kept between flushes to avoid reallocation
+    DeltaTable pins;
+    DeltaTable releases;
+    std::vector<TreeNode*> released_nodes;
+    std::vector<std::pair<size_t, TreeNode*>> candidates;  // Locks of the current run
+    std::vector<uint64_t> snapshot;
+
+    bool runDirect(const Op& op);
+    bool isCancellingPair(size_t index) const;
+    bool lockableSnapshot(TreeNode* node);
+    bool relatedToRun(TreeNode* node);
+    bool hasBlockedAncestor(TreeNode* node);
+    bool takeNode(TreeNode* node, int user_id);
+    void addRelease(TreeNode* node);
+    void applyReleases();
+
+    size_t runLocks(size_t begin, std::vector<bool>& results);
+    size_t runUnlocks(size_t begin, std::vector<bool>& results);
+
+public:
+    explicit LockBatch(NaryTreeLock& tree);
+
+    LockBatch(const LockBatch&) = delete;
+    LockBatch& operator=(const LockBatch&) = delete;
+
+    // Queue a call; its result is at the same position after flush()
+    void lock(int node_id, int user_id);
+    void unlock(int node_id, int user_id);
+    void upgradeLock(int node_id, int user_id);
+
+    size_t size() const { return ops.size(); }
+
+    /**
+     * Run every queued call in order and empty the queue
+     * @param results: replaced by one result per queued call
+     * @return number of calls that succeeded
+     *
+     * Time Complexity: O(k log N) for k calls, with one atomic RMW per
+     * distinct ancestor of each run instead of one per call and ancestor
+     */
+    size_t flush(std::vector<bool>& results);
+};
+
+#endif // LOCK_BATCH_H
@@ -0,0 +1,481 @@
+#ifndef LOCK_PROTOCOL_H
+#define LOCK_PROTOCOL_H
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Packed per-node lock state, stored in one std::atomic<uint64_t>
+ *
+ * Layout:
+ * - bits  0..31: owner user ID (kNoOwner when unlocked, read back as -1)
+ * - bits 32..55: locked descendant count (including in-flight lock attempts)
+ * - bits 56..59: version, bumped on every owner change
+ * - bits 60..63: intent flags
+ *     60 escalated: lock taken by escalation on the owner's behalf
+ *     61 pending:   escalation being set up or torn down
+ *     62 shadow:    lock counted only up to its nearest escalated ancestor
+ *     63 intent:    queued upgrade waiting for foreign descendants to drain
+ */
+struct NodeState {
+    static constexpr uint64_t kOwnerMask = 0xFFFFFFFFull;
+    static constexpr uint32_t kNoOwner = 0xFFFFFFFFu;
+
+    static constexpr int kCountShift = 32;
+    static constexpr uint64_t kCountOne = 1ull << kCountShift;
+    static constexpr uint64_t kCountMask = 0xFFFFFFull << kCountShift;
+
+    static constexpr int kVersionShift = 56;
+    static constexpr uint64_t kVersionOne = 1ull << kVersionShift;
+    static constexpr uint64_t kVersionMask = 0xFull << kVersionShift;
+
+    static constexpr int kFlagShift = 60;
+    static constexpr uint64_t kFlagMask = 0xFull << kFlagShift;
+    static constexpr uint64_t kEscalatedFlag = 1ull << 60;
+    static constexpr uint64_t kPendingFlag = 1ull << 61;
+    static constexpr uint64_t kShadowFlag = 1ull << 62;
+    static constexpr uint64_t kIntentFlag = 1ull << 63;
+
+    // Initial word: unlocked, no locked descendants, version 0
+    static constexpr uint64_t kUnlocked = kNoOwner;
+
+    static bool isLocked(uint64_t state) {
+        return (state & kOwnerMask) != kNoOwner;
+    }
+
+    static int owner(uint64_t state) {
+        return isLocked(state) ? static_cast<int>(state & kOwnerMask) : -1;
+    }
+
+    static int descendantCount(uint64_t state) {
+        return static_cast<int>((state & kCountMask) >> kCountShift);
+    }
+
+    static uint64_t version(uint64_t state) {
+        return (state & kVersionMask) >> kVersionShift;
+    }
+
+    static bool isEscalated(uint64_t state) { return (state & kEscalatedFlag) != 0; }
+    static bool isPending(uint64_t state) { return (state & kPendingFlag) != 0; }
+    static bool isShadow(uint64_t state) { return (state & kShadowFlag) != 0; }
+    static bool isIntent(uint64_t state) { return (state & kIntentFlag) != 0; }
+
+    // Locked by user_id, excluding a queued upgrade still waiting to drain
+    // (such a node cannot be taken over by another upgrade or escalation)
+    static bool isHeldBy(uint64_t state, int user_id) {
+        return owner(state) == user_id && !isIntent(state);
+    }
+
+    // Escalated on user_id's behalf and ready to cover new locks underneath
+    static bool absorbs(uint64_t state, int user_id) {
+        return isEscalated(state) && !isPending(state) && owner(state) == user_id;
+    }
+
+    // Same word with a new owner (-1 to unlock, which also clears the
+    // flags) and the version bumped
+    static uint64_t withOwner(uint64_t state, int user_id) {
+        uint64_t owner_bits = static_cast<uint32_t>(user_id);
+        uint64_t next_version = (state + kVersionOne) & kVersionMask;
+        uint64_t cleared = kOwnerMask | kVersionMask | (user_id == -1 ? kFlagMask : 0);
+        return (state & ~cleared) | next_version | owner_bits;
+    }
+};
+
+/**
+ * Per-thread contention counters, only updated when the engine is built
+ * with NARY_TREE_LOCK_STATS (the benchmark target does this)
+ */
+struct LockStats {
+    uint64_t lock_attempts = 0;
+    uint64_t cas_retries = 0;   // CAS lost to a concurrent change and re-read
+    uint64_t rollbacks = 0;     // Partially taken lock that had to be undone
+    uint64_t ancestor_rmws = 0; // Atomic RMWs on ancestor descendant counts
+    uint64_t escalations = 0;   // Subtrees converted into one escalated lock
+};
+
+// Counters of the calling thread (also NaryTreeLock::threadStats)
+inline LockStats& threadLockStats() {
+    thread_local LockStats stats;
+    return stats;
+}
+
+// Bump a LockStats counter of the calling thread (no-op without stats)
+#ifdef NARY_TREE_LOCK_STATS
+#define NARY_STAT(field) (++threadLockStats().field)
+#else
+#define NARY_STAT(field) ((void)0)
+#endif
+
+
+/**
+ * Lock protocol shared by NaryTreeLock and NaryForest
+ *
+ * Pin the ancestors, take the node with one CAS, re-check the ancestors
+ * and roll back on failure - written once over a node type and the tree
+ * that owns it (CRTP). The tree provides node and ancestor access:
+ * - Node* parentOf(Node* node)  (nullptr at the root)
+ * - std::vector<Node*> collectLockedDescendants(Node* node, int* counted)
+ * - void ancestorDrained(Node* ancestor, uint64_t prev_state, Node* node)
+ *   called when releasing node takes ancestor's descendant count to zero
+ * - void notifyReleased(Node* node)  called after node is unlocked
+ * and Node has a std::atomic<uint64_t> state (see NodeState).
+ *
+ * Escalation flags are honoured throughout; a tree that never sets them
+ * gets the plain protocol.
+ */
+template <typename Tree, typename Node>
+class LockProtocol {
+public:
+    bool lockNode(Node* node, int user_id, Node*& boundary);
+    bool unlockNode(Node* node, int user_id);
+    bool upgradeNode(Node* node, int user_id);
+
+    bool hasLockedAncestor(Node* node, int user_id = -1, Node** boundary = nullptr);
+    bool acquireAncestors(Node* node, int user_id, Node*& boundary);
+    bool validateAncestors(Node* node, int user_id);
+    void updateAncestorCount(Node* node, int delta, Node* stop = nullptr);
+    void releaseAncestors(Node* node, Node* boundary);
+    Node* escalationBoundary(Node* node);
+    bool releaseOwner(Node* node, int user_id, uint64_t* released_state = nullptr);
+    void releaseDescendants(const std::vector<Node*>& locked_descendants, int user_id);
+
+private:
+    Tree& tree() { return static_cast<Tree&>(*this); }
+};
+
+/**
+ * Lock a node (see NaryTreeLock::lock for the algorithm)
+ * Time Complexity: O(log N)
+ * @param boundary: receives the escalated ancestor the lock is counted up
+ *                  to, or nullptr when it is counted up to the root
+ */
+template <typename Tree, typename Node>
+bool LockProtocol<Tree, Node>::lockNode(Node* node, int user_id, Node*& boundary) {
+    NARY_STAT(lock_attempts);
+
+    // Check if node is locked or has a locked descendant
+    uint64_t observed = node->state.load();
+    if (NodeState::isLocked(observed) || NodeState::descendantCount(observed) > 0) {
+        return false;
+    }
+
+    // Check if any ancestor is locked
+    boundary = nullptr;
+    if (hasLockedAncestor(node, user_id, &boundary)) {
+        return false;
+    }
+
+    // Pin the ancestors; fails if one got locked since the pre-check
+    if (!acquireAncestors(node, user_id, boundary)) {
+        return false;
+    }
+
+    // Under an escalated ancestor the lock is counted only up to it
+    uint64_t flags = boundary ? NodeState::kShadowFlag : 0;
+
+    // Acquire the node: unlocked and no locked descendant, as one CAS
+    observed = node->state.load();
+    while (true) {
+        if (NodeState::isLocked(observed) || NodeState::descendantCount(observed) > 0) {
+            releaseAncestors(node, boundary);
+            NARY_STAT(rollbacks);
+            return false;
+        }
+        if (node->state.compare_exchange_weak(observed, NodeState::withOwner(observed, user_id) | flags)) {
+            break;
+        }
+        NARY_STAT(cas_retries);
+    }
+
+    if (!validateAncestors(node, user_id)) {
+        // An escalation may have turned the lock into a shadow lock since
+        // the pins were taken; unlockNode releases by the flags it ends with
+        unlockNode(node, user_id);
+        NARY_STAT(rollbacks);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Unlock a node held by user_id
+ * Time Complexity: O(log N)
+ *
+ * Clears the owner with one CAS, then drops the ancestor counts up to the
+ * root, or up to the escalated ancestor for a shadow lock.
+ */
+template <typename Tree, typename Node>
+bool LockProtocol<Tree, Node>::unlockNode(Node* node, int user_id) {
+    uint64_t released;
+    if (!releaseOwner(node, user_id, &released)) {
+        // Node is not locked by this user
+        return false;
+    }
+
+    // Update ancestor counts
+    releaseAncestors(node, NodeState::isShadow(released) ? escalationBoundary(node) : nullptr);
+
+    tree().notifyReleased(node);
+    return true;
+}
+
+/**
+ * Upgrade a node whose locked descendants all belong to user_id (see
+ * NaryTreeLock::upgradeLock for the algorithm)
+ * Time Complexity: O(M + log N) where M is number of locked descendants
+ */
+template <typename Tree, typename Node>
+bool LockProtocol<Tree, Node>::upgradeNode(Node* node, int user_id) {
+    // Check if node is already locked
+    uint64_t observed = node->state.load();
+    if (NodeState::isLocked(observed)) {
+        return false;
+    }
+
+    // Check if any ancestor is locked
+    Node* boundary = nullptr;
+    if (hasLockedAncestor(node, user_id, &boundary)) {
+        return false;
+    }
+
+    // Check if there are locked descendants
+    int locked_desc_count = NodeState::descendantCount(observed);
+    if (locked_desc_count == 0) {
+        return false;  // No descendants to upgrade
+    }
+
+    // Find locked descendants; all must belong to this user
+    int counted = 0;
+    std::vector<Node*> locked_descendants = tree().collectLockedDescendants(node, &counted);
+    if (counted != locked_desc_count) {
+        return false;
+    }
+    for (Node* desc : locked_descendants) {
+        if (!NodeState::isHeldBy(desc->state.load(), user_id)) {
+            return false;  // Some descendants locked by other users
+        }
+    }
+
+    // Pin ancestors first, as lockNode does, so the node is never visibly
+    // owned without its counts in place
+    if (!acquireAncestors(node, user_id, boundary)) {
+        return false;
+    }
+
+    // Take the node with the same count we verified; any descendant lock or
+    // unlock since the pre-check changes the word and fails the CAS
+    uint64_t flags = boundary ? NodeState::kShadowFlag : 0;
+    if (!node->state.compare_exchange_strong(observed, NodeState::withOwner(observed, user_id) | flags)) {
+        releaseAncestors(node, boundary);
+        return false;
+    }
+
+    // With the node held the locked set can only shrink. Re-scan to catch a
+    // foreign lock that replaced one of ours between the scan and the CAS.
+    locked_descendants = tree().collectLockedDescendants(node, nullptr);
+    bool foreign = false;
+    for (Node* desc : locked_descendants) {
+        if (!NodeState::isHeldBy(desc->state.load(), user_id)) {
+            foreign = true;
+        }
+    }
+
+    if (foreign || !validateAncestors(node, user_id)) {
+        // Skip the release if the user unlocked the node concurrently
+        unlockNode(node, user_id);
+        NARY_STAT(rollbacks);
+        return false;
+    }
+
+    // Unlock all descendants (they stay covered by the node, so nobody is
+    // woken)
+    releaseDescendants(locked_descendants, user_id);
+
+    return true;
+}
+
+/**
+ * Check if any ancestor is locked
+ * Time Complexity: O(log N) - traverses to root
+ *
+ * With a user_id, an ancestor escalated on that user's behalf does not
+ * block: the walk stops there and reports it through boundary.
+ */
+template <typename Tree, typename Node>
+bool LockProtocol<Tree, Node>::hasLockedAncestor(Node* node, int user_id, Node** boundary) {
+    Node* curr = tree().parentOf(node);
+
+    while (curr != nullptr) {
+        uint64_t state = curr->state.load();
+        if (NodeState::isLocked(state)) {
+            if (user_id != -1 && NodeState::absorbs(state, user_id)) {
+                if (boundary) *boundary = curr;
+                return false;
+            }
+            return true;
+        }
+        curr = tree().parentOf(curr);
+    }
+
+    if (boundary) *boundary = nullptr;
+    return false;
+}
+
+/**
+ * Register a lock attempt on every ancestor
+ * Time Complexity: O(log N) - traverses to root
+ *
+ * Each ancestor gets one fetch_add on its packed state. The returned word
+ * tells us atomically whether that ancestor was locked at the moment we
+ * pinned it; if so the increments made so far are undone and false is
+ * returned. Once this succeeds no ancestor can be locked until the counts
+ * are released, since lockNode requires a zero descendant count.
+ *
+ * An ancestor escalated on user_id's behalf absorbs the attempt: the walk
+ * stops there and it is returned as boundary (nullptr if we reached root).
+ */
+template <typename Tree, typename Node>
+bool LockProtocol<Tree, Node>::acquireAncestors(Node* node, int user_id, Node*& boundary) {
+    Node* curr = tree().parentOf(node);
+
+    while (curr != nullptr) {
+        uint64_t prev = curr->state.fetch_add(NodeState::kCountOne);
+        NARY_STAT(ancestor_rmws);
+
+        if (NodeState::isLocked(prev)) {
+            if (NodeState::absorbs(prev, user_id)) {
+                boundary = curr;
+                return true;
+            }
+
+            // Undo this ancestor and everything below it
+            releaseAncestors(node, curr);
+            NARY_STAT(rollbacks);
+            return false;
+        }
+        curr = tree().parentOf(curr);
+    }
+
+    boundary = nullptr;
+    return true;
+}
+
+/**
+ * Re-check ancestors after taking a node
+ * Time Complexity: O(log N) - traverses to root
+ *
+ * An upgrade or escalation whose count check matched by coincidence (one
+ * of its user's locks released while our attempt was counted) can take an
+ * ancestor after we pinned it. Only escalations on our own behalf may sit
+ * above a held lock.
+ */
+template <typename Tree, typename Node>
+bool LockProtocol<Tree, Node>::validateAncestors(Node* node, int user_id) {
+    Node* curr = tree().parentOf(node);
+
+    while (curr != nullptr) {
+        uint64_t state = curr->state.load();
+        if (NodeState::isLocked(state) &&
+            !(NodeState::isEscalated(state) && NodeState::owner(state) == user_id)) {
+            return false;
+        }
+        curr = tree().parentOf(curr);
+    }
+
+    return true;
+}
+
+/**
+ * Update locked descendant count for all ancestors up to (excluding) stop
+ * Time Complexity: O(log N) - traverses to root
+ *
+ * A decrement that drains an ancestor is reported to the tree, which
+ * releases a drained escalated lock and wakes unlock subscribers.
+ */
+template <typename Tree, typename Node>
+void LockProtocol<Tree, Node>::updateAncestorCount(Node* node, int delta, Node* stop) {
+    Node* curr = tree().parentOf(node);
+    uint64_t amount = static_cast<uint64_t>(delta < 0 ? -delta : delta) << NodeState::kCountShift;
+
+    while (curr != stop) {
+        if (delta < 0) {
+            uint64_t prev = curr->state.fetch_sub(amount);
+
+            if (NodeState::descendantCount(prev - amount) == 0) {
+                tree().ancestorDrained(curr, prev, node);
+            }
+        } else {
+            curr->state.fetch_add(amount);
+        }
+        NARY_STAT(ancestor_rmws);
+        curr = tree().parentOf(curr);
+    }
+}
+
+/**
+ * Drop one count from every ancestor up to boundary (inclusive), or up to
+ * the root when boundary is nullptr
+ */
+template <typename Tree, typename Node>
+void LockProtocol<Tree, Node>::releaseAncestors(Node* node, Node* boundary) {
+    updateAncestorCount(node, -1, boundary ? tree().parentOf(boundary) : nullptr);
+}
+
+/**
+ * Nearest escalated ancestor, where a shadow lock's counts stop
+ */
+template <typename Tree, typename Node>
+Node* LockProtocol<Tree, Node>::escalationBoundary(Node* node) {
+    Node* curr = tree().parentOf(node);
+
+    while (curr != nullptr && !NodeState::isEscalated(curr->state.load())) {
+        curr = tree().parentOf(curr);
+    }
+
+    return curr;
+}
+
+/**
+ * Clear the owner of a node if it is held by user_id (single-word CAS loop,
+ * retried only when the descendant count moves underneath us)
+ * Escalated locks are not released here; they drain on their own. Nor are
+ * queued upgrades still waiting; they complete or time out.
+ * @param released_state: receives the word before release (for its flags)
+ */
+template <typename Tree, typename Node>
+bool LockProtocol<Tree, Node>::releaseOwner(Node* node, int user_id, uint64_t* released_state) {
+    uint64_t observed = node->state.load();
+
+    while (true) {
+        if (NodeState::owner(observed) != user_id || NodeState::isEscalated(observed) ||
+            NodeState::isIntent(observed)) {
+            return false;
+        }
+        if (node->state.compare_exchange_weak(observed, NodeState::withOwner(observed, -1))) {
+            if (released_state) *released_state = observed;
+            return true;
+        }
+        NARY_STAT(cas_retries);
+    }
+}
+
+/**
+ * Unlock descendants found by collectLockedDescendants, deepest first so
+ * shadow locks drain before the escalated lock they are counted on
+ */
+template <typename Tree, typename Node>
+void LockProtocol<Tree, Node>::releaseDescendants(const std::vector<Node*>& locked_descendants, int user_id) {
+    for (auto it = locked_descendants.rbegin(); it != locked_descendants.rend(); ++it) {
+        Node* desc = *it;
+        uint64_t released;
+
+        // Skip any the user released concurrently
+        if (releaseOwner(desc, user_id, &released)) {
+            releaseAncestors(desc, NodeState::isShadow(released) ? escalationBoundary(desc) : nullptr);
+        }
+    }
+}
+
+#endif // LOCK_PROTOCOL_H
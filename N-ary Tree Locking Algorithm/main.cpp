@@ -1,9 +1,15 @@
 #include "nary_tree_lock.h"
+#include "trace_recorder.h"
+#include "unlock_notifier.h"
+#include "nary_forest.h"
+#include "lock_batch.h"
 #include <iostream>
 #include <thread>
 #include <vector>
 #include <chrono>
 #include <cassert>
+#include <cstdio>
+#include <algorithm>
 
 using namespace std;
 
@@ -397,6 +403,631 @@ void testEdgeCases() {
     assert(r3 == false);
 }
 
+/**
+ * Test Case 11: Concurrent Exclusion Invariant
+ */
+void testConcurrentExclusion() {
+    printTestHeader("Test 11: Concurrent Exclusion Invariant");
+
+    // 4-ary tree with 85 nodes (3 levels below root)
+    vector<string> names;
+    vector<int> parents;
+    for (int i = 0; i < 85; i++) {
+        names.push_back("Node_" + to_string(i));
+        parents.push_back(i == 0 ? -1 : (i - 1) / 4);
+    }
+
+    NaryTreeLock tree;
+    tree.buildTree(names, parents);
+
+    atomic<int> violations(0);
+    atomic<int> success_count(0);
+
+    auto thread_func = [&](int thread_id) {
+        unsigned int seed = 12345u * thread_id;
+        for (int i = 0; i < 2000; i++) {
+            seed = seed * 1103515245u + 12345u;
+            int node_id = (seed >> 8) % 85;
+
+            if (tree.lock(node_id, thread_id)) {
+                success_count++;
+
+                // While we hold the node no ancestor may be locked
+                for (TreeNode* curr = tree.getNode(node_id)->parent; curr; curr = curr->parent) {
+                    if (curr->lockedBy() != -1) {
+                        violations++;
+                    }
+                }
+
+                tree.unlock(node_id, thread_id);
+            }
+        }
+    };
+
+    vector<thread> threads;
+    for (int t = 1; t <= 4; t++) {
+        threads.push_back(thread(thread_func, t));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    // Every counter must return to zero once all locks are released
+    bool all_clear = true;
+    for (int i = 0; i < 85; i++) {
+        TreeNode* node = tree.getNode(i);
+        if (node->lockedBy() != -1 || node->lockedDescendantCount() != 0) {
+            all_clear = false;
+        }
+    }
+
+    cout << "Successful locks: " << success_count << endl;
+
+    printTestResult("No lock held under a locked ancestor", violations == 0);
+    assert(violations == 0);
+
+    printTestResult("All owners and counters cleared", all_clear);
+    assert(all_clear);
+}
+
+/**
+ * Test Case 12: Trace Record and Read Back
+ */
+void testTraceRoundTrip() {
+    printTestHeader("Test 12: Trace Record and Read Back");
+
+    vector<string> names = {"Root", "Child1", "Child2", "GrandChild1"};
+    vector<int> parents = {-1, 0, 0, 1};
+    const string path = "tree_lock_test_trace.bin";
+
+    NaryTreeLock tree;
+    tree.buildTree(names, parents);
+
+    {
+        TraceRecorder recorder(path, parents);
+        tree.setTraceRecorder(&recorder);
+
+        tree.lock(1, 100);         // true
+        tree.lock(1, 200);         // false
+        tree.unlock(1, 100);       // true
+        tree.lock(3, 100);         // true
+        tree.upgradeLock(1, 100);  // true
+        tree.unlock(1, 100);       // true
+
+        tree.setTraceRecorder(nullptr);
+        tree.lock(2, 100);         // Not recorded
+    }
+    tree.unlock(2, 100);
+
+    TraceReader trace(path);
+    remove(path.c_str());
+
+    bool shape_ok = trace.parentIds() == parents;
+    printTestResult("Tree shape stored in trace header", shape_ok);
+    assert(shape_ok);
+
+    bool count_ok = trace.threads().size() == 1 && trace.recordCount() == 6;
+    printTestResult("One thread, six records", count_ok);
+    assert(count_ok);
+
+    const vector<TraceRecord>& records = trace.threads()[0];
+    const TraceOp ops[] = {TraceOp::Lock, TraceOp::Lock, TraceOp::Unlock,
+                           TraceOp::Lock, TraceOp::UpgradeLock, TraceOp::Unlock};
+    const bool results[] = {true, false, true, true, true, true};
+    const int nodes[] = {1, 1, 1, 3, 1, 1};
+
+    bool records_ok = true;
+    for (int i = 0; i < 6; i++) {
+        records_ok = records_ok && records[i].op() == ops[i] &&
+                     records[i].result() == results[i] &&
+                     records[i].node_id == nodes[i] &&
+                     (i == 0 || records[i].timestamp() >= records[i - 1].timestamp());
+    }
+    printTestResult("Records match calls in order", records_ok);
+    assert(records_ok);
+
+    // A tiny ring overflows; every dropped call must show up as a gap
+    uint64_t dropped;
+    {
+        TraceRecorder recorder(path, parents, 4);
+        tree.setTraceRecorder(&recorder);
+        for (int i = 0; i < 1000; i++) {
+            tree.lock(2, 100);
+            tree.unlock(2, 100);
+        }
+        tree.setTraceRecorder(nullptr);
+        dropped = recorder.droppedRecords();
+    }
+
+    TraceReader lossy(path);
+    remove(path.c_str());
+
+    bool gaps_ok = lossy.droppedRecords() == dropped && lossy.recordCount() + dropped == 2000 &&
+                   (dropped == 0) == (lossy.gapCount() == 0);
+    printTestResult("Dropped records are marked in the trace", gaps_ok);
+    assert(gaps_ok);
+
+    // Header whose node 1 names a parent that does not exist
+    {
+        TraceRecorder recorder(path, {-1, 7, 0});
+    }
+    bool rejected = false;
+    try {
+        TraceReader corrupt(path);
+    } catch (const runtime_error&) {
+        rejected = true;
+    }
+    remove(path.c_str());
+    printTestResult("Corrupt tree shape rejected by reader", rejected);
+    assert(rejected);
+}
+
+/**
+ * Test Case 13: Lock Escalation
+ */
+void testLockEscalation() {
+    printTestHeader("Test 13: Lock Escalation");
+
+    // Root -> Parent (1) -> 8 leaves (2..9); Root -> Other (10) -> Leaf (11)
+    vector<string> names = {"Root", "Parent"};
+    vector<int> parents = {-1, 0};
+    for (int i = 2; i <= 9; i++) {
+        names.push_back("Leaf" + to_string(i));
+        parents.push_back(1);
+    }
+    names.push_back("Other"); parents.push_back(0);
+    names.push_back("OtherLeaf"); parents.push_back(10);
+
+    EscalationPolicy policy;
+    policy.max_locked_descendants = 4;
+
+    NaryTreeLock tree;
+    tree.buildTree(names, parents);
+    tree.setEscalationPolicy(policy);
+
+    // Fourth leaf lock escalates Parent
+    bool locked = tree.lock(2, 100) && tree.lock(3, 100) && tree.lock(4, 100) && tree.lock(5, 100);
+    printTestResult("Lock four leaves", locked);
+    assert(locked);
+
+    bool escalated = tree.isEscalated(1) && tree.getLockedBy(1) == 100;
+    printTestResult("Parent escalated for User 100", escalated);
+    assert(escalated);
+
+    bool root_count_one = tree.getNode(0)->lockedDescendantCount() == 1;
+    printTestResult("Root counts the escalated subtree once", root_count_one);
+    assert(root_count_one);
+
+    // Other users are still excluded; the owner keeps locking leaves
+    bool r1 = tree.lock(6, 200);
+    printTestResult("Other user locks leaf under escalation (should fail)", r1 == false);
+    assert(r1 == false);
+
+    bool r2 = tree.lock(6, 100);
+    printTestResult("Owner locks another leaf", r2);
+    assert(r2);
+
+    bool r3 = tree.getNode(0)->lockedDescendantCount() == 1;
+    printTestResult("Root count unchanged by covered lock", r3);
+    assert(r3);
+
+    bool r4 = tree.lock(11, 200) && !tree.lock(0, 200);
+    printTestResult("Sibling subtree independent, root still blocked", r4);
+    assert(r4);
+
+    // Unlocking every covered leaf releases the escalated lock
+    bool unlocked = tree.unlock(2, 100) && tree.unlock(3, 100) && tree.unlock(4, 100) &&
+                    tree.unlock(5, 100) && tree.unlock(6, 100);
+    printTestResult("Unlock covered leaves", unlocked);
+    assert(unlocked);
+
+    bool released = !tree.isLocked(1) && tree.getNode(1)->lockedDescendantCount() == 0;
+    printTestResult("Escalated lock released after last unlock", released);
+    assert(released);
+
+    tree.unlock(11, 200);
+    bool clear = tree.getNode(0)->lockedDescendantCount() == 0;
+    printTestResult("Root count back to zero", clear);
+    assert(clear);
+
+    // Mixed owners never escalate
+    tree.lock(7, 300);
+    tree.lock(2, 100);
+    tree.lock(3, 100);
+    tree.lock(4, 100);
+    bool not_escalated = !tree.isLocked(1);
+    printTestResult("No escalation with another user's lock present", not_escalated);
+    assert(not_escalated);
+    tree.unlock(7, 300);
+    tree.unlock(2, 100);
+    tree.unlock(3, 100);
+    tree.unlock(4, 100);
+
+    // upgradeLock turns an escalation into an ordinary lock
+    tree.lock(2, 100);
+    tree.lock(3, 100);
+    tree.lock(4, 100);
+    tree.lock(5, 100);
+    bool upgraded = tree.upgradeLock(1, 100) && !tree.isEscalated(1) &&
+                    tree.getLockedBy(1) == 100 && !tree.isLocked(2) && !tree.isLocked(5);
+    printTestResult("Upgrade converts escalated lock", upgraded);
+    assert(upgraded);
+
+    bool final_unlock = tree.unlock(1, 100) && tree.getNode(0)->lockedDescendantCount() == 0;
+    printTestResult("Unlock upgraded node", final_unlock);
+    assert(final_unlock);
+
+    // A lock whose CAS lands after an escalation's re-scan stays ordinary
+    // (counted up to the root). Recreate that by hand on leaf 7: being
+    // unlocked last, it must still release the escalated parent.
+    tree.lock(2, 100);
+    tree.lock(3, 100);
+    tree.lock(4, 100);
+    tree.lock(5, 100);
+    TreeNode* late = tree.getNode(7);
+    late->state.store(NodeState::withOwner(late->state.load(), 100));
+    tree.getNode(1)->state.fetch_add(NodeState::kCountOne);
+    tree.getNode(0)->state.fetch_add(NodeState::kCountOne);
+
+    tree.unlock(2, 100);
+    tree.unlock(3, 100);
+    tree.unlock(4, 100);
+    tree.unlock(5, 100);
+    bool late_drained = tree.isEscalated(1) && tree.unlock(7, 100) && !tree.isLocked(1) &&
+                        tree.getNode(1)->lockedDescendantCount() == 0 &&
+                        tree.getNode(0)->lockedDescendantCount() == 0;
+    printTestResult("Late ordinary lock still drains the escalation", late_drained);
+    assert(late_drained);
+}
+
+/**
+ * Test Case 14: Unlock Notification
+ */
+void testUnlockNotification() {
+    printTestHeader("Test 14: Unlock Notification");
+
+    // Root -> A (1) -> A1 (2), A2 (3); Root -> B (4) -> B1 (5)
+    vector<string> names = {"Root", "A", "A1", "A2", "B", "B1"};
+    vector<int> parents = {-1, 0, 1, 1, 0, 4};
+
+    NaryTreeLock tree;
+    tree.buildTree(names, parents);
+
+    UnlockNotifier notifier;
+    tree.setUnlockNotifier(&notifier);
+    vector<UnlockEvent> events;
+
+    // Descendant conflict: A waits for both of its locked children
+    tree.lock(2, 100);
+    tree.lock(3, 100);
+    uint64_t sub_a = tree.subscribeUnlock(1);
+    bool r1 = sub_a != 0 && !notifier.wait(0);
+    printTestResult("Subscribe to blocked node, no event yet", r1);
+    assert(r1);
+
+    tree.lock(5, 200);
+    tree.unlock(5, 200);
+    tree.unlock(2, 100);
+    bool r2 = notifier.drain(events) == 0;
+    printTestResult("Unrelated unlock and partial release wake nobody", r2);
+    assert(r2);
+
+    tree.unlock(3, 100);
+    bool r3 = notifier.wait(0) && notifier.drain(events) == 1 &&
+              events[0].subscription_id == sub_a && events[0].node_id == 1 &&
+              events[0].released_node_id == 3;
+    printTestResult("Last descendant unlock wakes A through the eventfd", r3);
+    assert(r3);
+    events.clear();
+
+    // Ancestor conflict
+    tree.lock(1, 100);
+    uint64_t sub_a1 = tree.subscribeUnlock(2);
+    tree.unlock(1, 100);
+    bool r4 = notifier.drain(events) == 1 && events[0].subscription_id == sub_a1 &&
+              events[0].released_node_id == 1;
+    printTestResult("Ancestor unlock wakes descendant subscriber", r4);
+    assert(r4);
+    events.clear();
+
+    // Already lockable: fires at once, and only once
+    uint64_t sub_b = tree.subscribeUnlock(4);
+    tree.lock(4, 200);
+    tree.unlock(4, 200);
+    bool r5 = notifier.drain(events) == 1 && events[0].subscription_id == sub_b &&
+              events[0].released_node_id == -1;
+    printTestResult("Lockable node fires once on subscribe", r5);
+    assert(r5);
+    events.clear();
+
+    // upgradeLock moves the conflict up, so it wakes nobody
+    tree.lock(2, 100);
+    tree.lock(3, 100);
+    tree.subscribeUnlock(1);
+    bool r6 = tree.upgradeLock(1, 100) && notifier.drain(events) == 0;
+    printTestResult("upgradeLock wakes nobody", r6);
+    assert(r6);
+
+    tree.unlock(1, 100);
+    bool r7 = notifier.drain(events) == 1 && events[0].node_id == 1;
+    printTestResult("Unlock after upgrade wakes subscriber", r7);
+    assert(r7);
+    events.clear();
+
+    // Cancelled subscriptions never fire
+    tree.lock(4, 200);
+    uint64_t sub_b1 = tree.subscribeUnlock(5);
+    bool cancelled = tree.unsubscribeUnlock(sub_b1) && !tree.unsubscribeUnlock(sub_b1);
+    tree.unlock(4, 200);
+    bool r8 = cancelled && notifier.drain(events) == 0 &&
+              tree.getNode(0)->subtree_subscriptions.load() == 0;
+    printTestResult("Unsubscribe cancels pending subscription", r8);
+    assert(r8);
+
+    bool r9 = tree.subscribeUnlock(999) == 0;
+    printTestResult("Subscribe to invalid node (should fail)", r9);
+    assert(r9);
+    // Detaching the notifier drops pending subscriptions; releases that
+    // would have fired them afterwards are harmless
+    tree.lock(4, 200);
+    bool pending = tree.subscribeUnlock(0) != 0 && notifier.drain(events) == 0;
+    tree.setUnlockNotifier(nullptr);
+    bool unlocked = tree.unlock(4, 200);
+    bool r10 = pending && unlocked && tree.subscribeUnlock(2) == 0 &&
+               tree.getNode(0)->subtree_subscriptions.load() == 0 && notifier.drain(events) == 0;
+    printTestResult("Detached notifier drops subscriptions", r10);
+    assert(r10);
+}
+
+/**
+ * Test Case 15: Multi-tenant Forest
+ */
+void testForest() {
+    printTestHeader("Test 15: Multi-tenant Forest");
+
+    NaryForest forest;
+
+    // Same shape as Test 2: Root -> A (1) -> A1 (2); Root -> B (3)
+    vector<int> parents = {-1, 0, 1, 0};
+    NaryForest::TreeId t1 = forest.createTree(parents);
+    NaryForest::TreeId t2 = forest.createTree(parents);
+
+    bool r1 = t1 != t2 && forest.treeCount() == 2 && forest.nodeCount(t1) == 4;
+    printTestResult("Create two trees", r1);
+    assert(r1);
+
+    // Lock rules hold per tree
+    bool r2 = forest.lock(t1, 1, 100) && !forest.lock(t1, 2, 200) && !forest.lock(t1, 0, 200) &&
+              forest.lock(t1, 3, 200);
+    printTestResult("Ancestor and descendant constraints within a tree", r2);
+    assert(r2);
+
+    bool r3 = forest.lock(t2, 0, 300) && forest.getLockedBy(t2, 0) == 300 &&
+              forest.getLockedBy(t1, 0) == -1;
+    printTestResult("Trees are independent", r3);
+    assert(r3);
+
+    bool r4 = forest.unlock(t1, 1, 100) && forest.unlock(t1, 3, 200) && forest.unlock(t2, 0, 300);
+    printTestResult("Unlock in both trees", r4);
+    assert(r4);
+
+    forest.lock(t1, 2, 100);
+    forest.lock(t1, 3, 100);
+    bool r5 = forest.upgradeLock(t1, 0, 100) && forest.isLocked(t1, 0) &&
+              !forest.isLocked(t1, 2) && !forest.isLocked(t1, 3);
+    printTestResult("Upgrade lock within a tree", r5);
+    assert(r5);
+    forest.unlock(t1, 0, 100);
+
+    // Destroyed IDs are rejected, even once the slot is reused
+    bool destroyed = forest.destroyTree(t1) && !forest.destroyTree(t1);
+    NaryForest::TreeId t3 = forest.createTree({-1, 0, 0});
+    bool r6 = destroyed && t3 != t1 && !forest.lock(t1, 0, 100) && forest.nodeCount(t1) == -1 &&
+              forest.nodeCount(t3) == 3 && forest.lock(t3, 1, 100) && forest.lock(t3, 2, 100);
+    printTestResult("Stale tree ID rejected after slot reuse", r6);
+    assert(r6);
+
+    bool r7 = forest.upgradeLock(t3, 0, 100) && forest.unlock(t3, 0, 100);
+    printTestResult("Reused block starts clean", r7);
+    assert(r7);
+
+    // Malformed trees are refused
+    int rejected = 0;
+    vector<vector<int>> bad = {{}, {0}, {-1, -1}, {-1, 5}, {-1, 2, 1}};
+    for (const vector<int>& shape : bad) {
+        try {
+            forest.createTree(shape);
+        } catch (const invalid_argument&) {
+            rejected++;
+        }
+    }
+    bool r8 = rejected == static_cast<int>(bad.size()) && forest.treeCount() == 2;
+    printTestResult("Malformed parent arrays rejected", r8);
+    assert(r8);
+
+    // Bulk reset drops every tree
+    forest.clear();
+    NaryForest::TreeId t4 = forest.createTree(parents);
+    bool r9 = forest.treeCount() == 1 && forest.nodeCount(t2) == -1 && forest.lock(t4, 2, 100);
+    printTestResult("clear() drops all trees", r9);
+    assert(r9);
+
+    ForestMemory memory = forest.memoryUsage();
+    bool r10 = memory.trees == 1 && memory.payload == 4 * sizeof(ForestNode) + 3 * sizeof(int32_t) &&
+               memory.allocated >= memory.payload;
+    printTestResult("Memory accounting", r10);
+    assert(r10);
+}
+
+/**
+ * Test Case 16: Queued Upgrade
+ */
+void testQueuedUpgrade() {
+    printTestHeader("Test 16: Queued Upgrade");
+
+    // Root -> Parent (1) -> 8 leaves (2..9)
+    vector<string> names = {"Root", "Parent"};
+    vector<int> parents = {-1, 0};
+    for (int i = 2; i <= 9; i++) {
+        names.push_back("Leaf" + to_string(i));
+        parents.push_back(1);
+    }
+
+    NaryTreeLock tree;
+    tree.buildTree(names, parents);
+
+    tree.lock(2, 100);
+    tree.lock(3, 200);
+
+    bool r1 = !tree.upgradeLock(1, 100);
+    printTestResult("Plain upgrade fails with a foreign lock", r1);
+    assert(r1);
+
+    // Timeout withdraws the intent and leaves everything as it was
+    bool timed_out = !tree.upgradeLockQueued(1, 100, chrono::milliseconds(10));
+    bool r2 = timed_out && !tree.isLocked(1) && tree.getLockedBy(2) == 100 &&
+              tree.getNode(0)->lockedDescendantCount() == 2 && tree.lock(4, 300) && tree.unlock(4, 300);
+    printTestResult("Timeout restores the tree", r2);
+    assert(r2);
+
+    // While the intent is registered new locks underneath are rejected,
+    // and the upgrade completes once the foreign lock drains
+    bool upgraded = false;
+    thread upgrader([&]() {
+        upgraded = tree.upgradeLockQueued(1, 100, chrono::seconds(10));
+    });
+    while (!tree.isUpgradePending(1)) {
+        this_thread::yield();
+    }
+
+    bool r3 = !tree.isLocked(1) && !tree.lock(4, 300) && !tree.lock(5, 100);
+    printTestResult("New descendant locks rejected while draining", r3);
+    assert(r3);
+
+    tree.unlock(3, 200);
+    upgrader.join();
+    bool r4 = upgraded && tree.getLockedBy(1) == 100 && !tree.isLocked(2) && !tree.isLocked(3) &&
+              tree.getNode(1)->lockedDescendantCount() == 0;
+    printTestResult("Upgrade completes after the foreign lock drains", r4);
+    assert(r4);
+
+    tree.unlock(1, 100);
+    bool r5 = !tree.upgradeLockQueued(1, 100, chrono::milliseconds(10)) &&
+              tree.getNode(0)->lockedDescendantCount() == 0;
+    printTestResult("Queued upgrade without own descendant locks (should fail)", r5);
+    assert(r5);
+}
+
+/**
+ * Test Case 17: Batched Submission
+ */
+void testLockBatch() {
+    printTestHeader("Test 17: Batched Submission");
+
+    // Root -> A (1), B (2); A -> 3, 4; B -> 5, 6
+    NaryTreeLock tree;
+    tree.buildTree({"Root", "A", "B", "A1", "A2", "B1", "B2"}, {-1, 0, 0, 1, 1, 2, 2});
+
+    LockBatch batch(tree);
+    batch.lock(3, 100);
+    batch.lock(4, 100);
+    batch.lock(1, 100);        // Above the two locks before it
+    batch.lock(5, 200);
+    batch.unlock(3, 100);
+    batch.unlock(4, 100);
+    batch.lock(1, 100);        // Sees the unlocks before it
+    batch.lock(3, 100);
+    batch.lock(2, 300);        // Not lockable: both calls fail
+    batch.unlock(2, 300);
+    batch.lock(6, 200);        // Cancelling pair
+    batch.unlock(6, 200);
+    batch.upgradeLock(2, 200);
+
+    vector<bool> results;
+    size_t succeeded = batch.flush(results);
+    vector<bool> expected = {true, true, false, true, true, true, true, false, false, false, true, true, true};
+
+    bool r1 = results == expected && succeeded == 9 && batch.size() == 0;
+    printTestResult("Per-call results match direct calls in order", r1);
+    assert(r1);
+
+    bool r2 = tree.getLockedBy(1) == 100 && tree.getLockedBy(2) == 200 && !tree.isLocked(3) &&
+              !tree.isLocked(5) && !tree.isLocked(6) && tree.getNode(0)->lockedDescendantCount() == 2 &&
+              tree.getNode(1)->lockedDescendantCount() == 0 && tree.getNode(2)->lockedDescendantCount() == 0;
+    printTestResult("Shared ancestor updates leave exact counts", r2);
+    assert(r2);
+
+    // A pair on a node the user already holds is not skipped: the lock
+    // fails and the unlock releases it
+    batch.lock(1, 100);
+    batch.unlock(1, 100);
+    batch.unlock(2, 200);
+    batch.flush(results);
+    bool r3 = results == vector<bool>({false, true, true}) && !tree.isLocked(1) && !tree.isLocked(2) &&
+              tree.getNode(0)->lockedDescendantCount() == 0;
+    printTestResult("Pair on an already held node unlocks it", r3);
+    assert(r3);
+
+    // Concurrent batches on a 4-ary tree of 85 nodes
+    vector<int> parents = {-1};
+    vector<string> names = {"N0"};
+    for (int i = 1; i < 85; i++) {
+        parents.push_back((i - 1) / 4);
+        names.push_back("N" + to_string(i));
+    }
+    NaryTreeLock shared_tree;
+    shared_tree.buildTree(names, parents);
+
+    const int num_threads = 4;
+    vector<int> failed_unlocks(num_threads, 0);
+    vector<thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            LockBatch thread_batch(shared_tree);
+            vector<bool> thread_results;
+            unsigned seed = 7 + t;
+            for (int round = 0; round < 2000; round++) {
+                vector<int> nodes;
+                for (int k = 0; k < 4; k++) {
+                    seed = seed * 1103515245 + 12345;
+                    nodes.push_back((seed >> 8) % 85);
+                }
+                // Three locks kept, then a lock/unlock pair on a node not among them
+                for (int k = 0; k < 3; k++) {
+                    thread_batch.lock(nodes[k], t);
+                }
+                if (find(nodes.begin(), nodes.begin() + 3, nodes[3]) == nodes.begin() + 3) {
+                    thread_batch.lock(nodes[3], t);
+                    thread_batch.unlock(nodes[3], t);
+                }
+                thread_batch.flush(thread_results);
+
+                for (int k = 0; k < 3; k++) {
+                    if (thread_results[k]) thread_batch.unlock(nodes[k], t);
+                }
+                vector<bool> unlock_results;
+                thread_batch.flush(unlock_results);
+                for (bool unlocked : unlock_results) {
+                    if (!unlocked) failed_unlocks[t]++;
+                }
+            }
+        });
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+
+    bool clean = true;
+    for (int i = 0; i < 85; i++) {
+        clean = clean && !shared_tree.isLocked(i) && shared_tree.getNode(i)->lockedDescendantCount() == 0;
+    }
+    for (int failures : failed_unlocks) {
+        clean = clean && failures == 0;
+    }
+    printTestResult("Concurrent batches release everything they took", clean);
+    assert(clean);
+}
+
 int main() {
     cout << YELLOW << "\n"
          << "================================================\n"
@@ -417,6 +1048,13 @@ int main() {
         testComplexTree();
         testPerformance();
         testEdgeCases();
+        testConcurrentExclusion();
+        testTraceRoundTrip();
+        testLockEscalation();
+        testUnlockNotification();
+        testForest();
+        testQueuedUpgrade();
+        testLockBatch();
 
         cout << "\n" << GREEN << "=====================================" << endl;
         cout << "  All Tests Passed Successfully!" << endl;
@@ -0,0 +1,449 @@
+#include "nary_forest.h"
+#include <stdexcept>
+#include <new>
+#include <algorithm>
+
+namespace {
+
+/**
+ * One forest tree, as node and ancestor access for LockProtocol
+ * Forest trees never escalate, notify or trace, so the hooks are plain.
+ */
+class ForestTree : public LockProtocol<ForestTree, ForestNode> {
+public:
+    ForestTree(ForestNode* tree_nodes, uint32_t tree_node_count)
+        : nodes(tree_nodes), node_count(tree_node_count) {}
+
+    ForestNode* parentOf(ForestNode* node) {
+        return node->parent == -1 ? nullptr : &nodes[node->parent];
+    }
+
+    // Locked descendants, depth first (all of them are counted)
+    std::vector<ForestNode*> collectLockedDescendants(ForestNode* node, int* counted) {
+        const int32_t* child_ids = reinterpret_cast<const int32_t*>(
+            reinterpret_cast<char*>(nodes) + node_count * sizeof(ForestNode));
+        std::vector<ForestNode*> locked_descendants;
+        std::vector<ForestNode*> pending(1, node);
+
+        while (!pending.empty()) {
+            ForestNode* curr = pending.back();
+            pending.pop_back();
+
+            uint32_t index = static_cast<uint32_t>(curr - nodes);
+            uint32_t end = index + 1 < node_count ? nodes[index + 1].first_child : node_count - 1;
+            for (uint32_t c = curr->first_child; c < end; c++) {
+                ForestNode* child = &nodes[child_ids[c]];
+                if (NodeState::isLocked(child->state.load())) {
+                    locked_descendants.push_back(child);
+                }
+                pending.push_back(child);
+            }
+        }
+
+        if (counted) *counted = static_cast<int>(locked_descendants.size());
+        return locked_descendants;
+    }
+
+    void ancestorDrained(ForestNode*, uint64_t, ForestNode*) {}
+    void notifyReleased(ForestNode*) {}
+
+private:
+    ForestNode* nodes;
+    uint32_t node_count;
+};
+
+}  // namespace
+
+// NaryForest Implementation
+NaryForest::NaryForest(size_t chunk_size)
+    : slot_count(0), free_slot(kNoSlot), tree_count(0),
+      chunk_bytes(chunk_size), current_chunk(0), bump_offset(0),
+      payload_bytes(0), allocated_bytes(0) {
+    for (uint32_t page = 0; page < kMaxPages; page++) {
+        directory[page].store(nullptr, std::memory_order_relaxed);
+    }
+    for (int i = 0; i < kSizeClasses; i++) {
+        free_blocks[i] = nullptr;
+    }
+}
+
+NaryForest::~NaryForest() {
+    for (uint32_t page = 0; page < kMaxPages; page++) {
+        delete[] directory[page].load();
+    }
+    for (char* chunk : chunks) {
+        ::operator delete(chunk);
+    }
+}
+
+/**
+ * Bytes a tree of node_count nodes needs: the nodes, then one int32 per
+ * non-root node for the child lists
+ */
+size_t NaryForest::blockBytes(uint32_t node_count) {
+    return node_count * sizeof(ForestNode) + (node_count - 1) * sizeof(int32_t);
+}
+
+/**
+ * Size class of a block
+ * - Up to 1 KiB: multiples of 16 bytes (64 classes)
+ * - Above: four classes per power of two, so rounding wastes under 25%
+ */
+int NaryForest::sizeClass(size_t bytes, size_t& class_bytes) {
+    if (bytes <= 1024) {
+        int index = static_cast<int>((bytes + 15) / 16) - 1;
+        class_bytes = (index + 1) * 16;
+        return index;
+    }
+
+    int k = 10;  // bytes is in (2^k, 2^(k+1)]
+    while ((static_cast<size_t>(2) << k) < bytes) {
+        k++;
+    }
+    size_t step = static_cast<size_t>(1) << (k - 2);
+    size_t units = (bytes + step - 1) / step;  // 5..8
+    class_bytes = units * step;
+    return 64 + (k - 10) * 4 + static_cast<int>(units - 5);
+}
+
+/**
+ * Take a block from its size-class free list, else bump-allocate it from
+ * the arena (caller holds structure_mutex)
+ */
+char* NaryForest::allocateBlock(size_t bytes, int size_class) {
+    if (free_blocks[size_class]) {
+        char* block = free_blocks[size_class];
+        free_blocks[size_class] = *reinterpret_cast<char**>(block);
+        return block;
+    }
+
+    if (chunks.empty() || bump_offset + bytes > chunk_sizes[current_chunk]) {
+        // Move on to the next chunk that fits (kept from before a clear()),
+        // or reserve a new one
+        size_t next = chunks.empty() ? 0 : current_chunk + 1;
+        while (next < chunks.size() && chunk_sizes[next] < bytes) {
+            next++;
+        }
+        if (next == chunks.size()) {
+            size_t size = std::max(chunk_bytes, bytes);
+            chunks.push_back(static_cast<char*>(::operator new(size)));
+            chunk_sizes.push_back(size);
+        }
+        current_chunk = next;
+        bump_offset = 0;
+    }
+
+    char* block = chunks[current_chunk] + bump_offset;
+    bump_offset += bytes;
+    return block;
+}
+
+NaryForest::TreeSlot* NaryForest::slotAt(uint32_t index) {
+    uint32_t page = index / kPageSlots;
+    if (page >= kMaxPages) return nullptr;
+
+    TreeSlot* slots = directory[page].load(std::memory_order_acquire);
+    return slots ? &slots[index % kPageSlots] : nullptr;
+}
+
+/**
+ * Reuse a free slot or open the next one (caller holds structure_mutex)
+ */
+uint32_t NaryForest::allocateSlot() {
+    if (free_slot != kNoSlot) {
+        uint32_t index = free_slot;
+        free_slot = slotAt(index)->node_count;
+        return index;
+    }
+
+    if (slot_count == kPageSlots * kMaxPages) {
+        throw std::runtime_error("forest is full");
+    }
+
+    uint32_t index = slot_count++;
+    uint32_t page = index / kPageSlots;
+    if (!directory[page].load(std::memory_order_relaxed)) {
+        TreeSlot* slots = new TreeSlot[kPageSlots];
+        for (uint32_t i = 0; i < kPageSlots; i++) {
+            slots[i].block.store(nullptr, std::memory_order_relaxed);
+            slots[i].generation.store(1, std::memory_order_relaxed);
+            slots[i].node_count = 0;
+        }
+        directory[page].store(slots, std::memory_order_release);
+    }
+    return index;
+}
+
+/**
+ * Add a tree
+ * Time Complexity: O(n)
+ *
+ * Algorithm:
+ * 1. Under the structure mutex, take a slot and a block - O(1)
+ * 2. Lay out the nodes and build the child lists in place (first_child
+ *    doubles as the per-node child counter)
+ * 3. Check every node is reachable from the single root; undo otherwise
+ */
+NaryForest::TreeId NaryForest::createTree(const std::vector<int>& parent_ids) {
+    size_t count = parent_ids.size();
+    if (count == 0 || count > static_cast<size_t>(NodeState::kCountMask >> NodeState::kCountShift)) {
+        throw std::invalid_argument("tree must have between 1 and 2^24 - 1 nodes");
+    }
+
+    uint32_t node_count = static_cast<uint32_t>(count);
+    int root_id = -1;
+    for (uint32_t i = 0; i < node_count; i++) {
+        int parent_id = parent_ids[i];
+        if (parent_id == -1) {
+            if (root_id != -1) {
+                throw std::invalid_argument("parent_ids has more than one root");
+            }
+            root_id = static_cast<int>(i);
+        } else if (parent_id < 0 || parent_id >= static_cast<int>(node_count) ||
+                   parent_id == static_cast<int>(i)) {
+            throw std::invalid_argument("parent_ids has an invalid parent");
+        }
+    }
+    if (root_id == -1) {
+        throw std::invalid_argument("parent_ids has no root");
+    }
+
+    size_t payload = blockBytes(node_count);
+    size_t class_bytes;
+    int size_class = sizeClass(payload, class_bytes);
+
+    uint32_t index;
+    char* block;
+    {
+        std::lock_guard<std::mutex> guard(structure_mutex);
+        index = allocateSlot();
+        block = allocateBlock(class_bytes, size_class);
+    }
+
+    // Nodes, with first_child counting children for now
+    ForestNode* nodes = reinterpret_cast<ForestNode*>(block);
+    for (uint32_t i = 0; i < node_count; i++) {
+        ForestNode* node = new (&nodes[i]) ForestNode;
+        node->state.store(NodeState::kUnlocked, std::memory_order_relaxed);
+        node->parent = parent_ids[i];
+        node->first_child = 0;
+    }
+    for (uint32_t i = 0; i < node_count; i++) {
+        if (nodes[i].parent != -1) {
+            nodes[nodes[i].parent].first_child++;
+        }
+    }
+
+    // Counts -> start offsets, fill (each offset advances to its end),
+    // then shift ends back into starts
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < node_count; i++) {
+        uint32_t children = nodes[i].first_child;
+        nodes[i].first_child = offset;
+        offset += children;
+    }
+    int32_t* child_ids = reinterpret_cast<int32_t*>(block + node_count * sizeof(ForestNode));
+    for (uint32_t i = 0; i < node_count; i++) {
+        if (nodes[i].parent != -1) {
+            child_ids[nodes[nodes[i].parent].first_child++] = static_cast<int32_t>(i);
+        }
+    }
+    for (uint32_t i = node_count - 1; i > 0; i--) {
+        nodes[i].first_child = nodes[i - 1].first_child;
+    }
+    nodes[0].first_child = 0;
+
+    // A parent cycle leaves nodes unreachable from the root
+    thread_local std::vector<int> reached;
+    reached.clear();
+    reached.push_back(root_id);
+    for (size_t i = 0; i < reached.size(); i++) {
+        int id = reached[i];
+        uint32_t end = id + 1 < static_cast<int>(node_count) ? nodes[id + 1].first_child : node_count - 1;
+        for (uint32_t c = nodes[id].first_child; c < end; c++) {
+            reached.push_back(child_ids[c]);
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(structure_mutex);
+    TreeSlot* slot = slotAt(index);
+
+    if (reached.size() != node_count) {
+        *reinterpret_cast<char**>(block) = free_blocks[size_class];
+        free_blocks[size_class] = block;
+        slot->node_count = free_slot;
+        free_slot = index;
+        throw std::invalid_argument("parent_ids contains a cycle");
+    }
+
+    slot->node_count = node_count;
+    slot->block.store(block, std::memory_order_release);
+    tree_count++;
+    payload_bytes += payload;
+    allocated_bytes += class_bytes;
+
+    return (static_cast<TreeId>(slot->generation.load()) << 32) | index;
+}
+
+/**
+ * Remove a tree
+ * Time Complexity: O(1)
+ *
+ * Bumping the generation first makes the old ID fail before the block is
+ * handed to anyone else.
+ */
+bool NaryForest::destroyTree(TreeId tree_id) {
+    std::lock_guard<std::mutex> guard(structure_mutex);
+
+    uint32_t index = static_cast<uint32_t>(tree_id);
+    TreeSlot* slot = slotAt(index);
+    if (!slot || slot->generation.load() != static_cast<uint32_t>(tree_id >> 32)) {
+        return false;
+    }
+    char* block = slot->block.load();
+    if (!block) {
+        return false;
+    }
+
+    slot->generation.fetch_add(1);
+    slot->block.store(nullptr);
+
+    size_t payload = blockBytes(slot->node_count);
+    size_t class_bytes;
+    int size_class = sizeClass(payload, class_bytes);
+    *reinterpret_cast<char**>(block) = free_blocks[size_class];
+    free_blocks[size_class] = block;
+
+    slot->node_count = free_slot;
+    free_slot = index;
+    tree_count--;
+    payload_bytes -= payload;
+    allocated_bytes -= class_bytes;
+
+    return true;
+}
+
+void NaryForest::clear() {
+    std::lock_guard<std::mutex> guard(structure_mutex);
+
+    free_slot = kNoSlot;
+    for (uint32_t index = slot_count; index-- > 0;) {
+        TreeSlot* slot = slotAt(index);
+        if (slot->block.load()) {
+            slot->generation.fetch_add(1);
+            slot->block.store(nullptr);
+        }
+        slot->node_count = free_slot;
+        free_slot = index;
+    }
+
+    for (int i = 0; i < kSizeClasses; i++) {
+        free_blocks[i] = nullptr;
+    }
+    current_chunk = 0;
+    bump_offset = 0;
+    tree_count = 0;
+    payload_bytes = 0;
+    allocated_bytes = 0;
+}
+
+ForestNode* NaryForest::findNode(TreeId tree_id, int node_id, ForestNode** nodes, uint32_t* node_count) {
+    TreeSlot* slot = slotAt(static_cast<uint32_t>(tree_id));
+    if (!slot || slot->generation.load(std::memory_order_acquire) != static_cast<uint32_t>(tree_id >> 32)) {
+        return nullptr;
+    }
+
+    char* block = slot->block.load(std::memory_order_acquire);
+    if (!block || node_id < 0 || static_cast<uint32_t>(node_id) >= slot->node_count) {
+        return nullptr;
+    }
+
+    ForestNode* tree_nodes = reinterpret_cast<ForestNode*>(block);
+    if (nodes) *nodes = tree_nodes;
+    if (node_count) *node_count = slot->node_count;
+    return &tree_nodes[node_id];
+}
+
+/**
+ * Lock a node of a tree
+ * Time Complexity: O(log N), same algorithm as NaryTreeLock::lock
+ */
+bool NaryForest::lock(TreeId tree_id, int node_id, int user_id) {
+    ForestNode* nodes;
+    uint32_t node_count;
+    ForestNode* node = findNode(tree_id, node_id, &nodes, &node_count);
+    if (!node || user_id == -1) return false;
+
+    ForestNode* boundary;
+    return ForestTree(nodes, node_count).lockNode(node, user_id, boundary);
+}
+
+/**
+ * Unlock a node of a tree
+ * Time Complexity: O(log N)
+ */
+bool NaryForest::unlock(TreeId tree_id, int node_id, int user_id) {
+    ForestNode* nodes;
+    uint32_t node_count;
+    ForestNode* node = findNode(tree_id, node_id, &nodes, &node_count);
+    if (!node || user_id == -1) return false;
+
+    return ForestTree(nodes, node_count).unlockNode(node, user_id);
+}
+
+/**
+ * Upgrade lock within a tree
+ * Time Complexity: O(M + log N), same algorithm as NaryTreeLock::upgradeLock
+ */
+bool NaryForest::upgradeLock(TreeId tree_id, int node_id, int user_id) {
+    ForestNode* nodes;
+    uint32_t node_count;
+    ForestNode* node = findNode(tree_id, node_id, &nodes, &node_count);
+    if (!node || user_id == -1) return false;
+
+    return ForestTree(nodes, node_count).upgradeNode(node, user_id);
+}
+
+bool NaryForest::isLocked(TreeId tree_id, int node_id) {
+    ForestNode* node = findNode(tree_id, node_id);
+    if (!node) return false;
+    return NodeState::isLocked(node->state.load());
+}
+
+int NaryForest::getLockedBy(TreeId tree_id, int node_id) {
+    ForestNode* node = findNode(tree_id, node_id);
+    if (!node) return -1;
+    return NodeState::owner(node->state.load());
+}
+
+int NaryForest::nodeCount(TreeId tree_id) {
+    uint32_t node_count;
+    if (!findNode(tree_id, 0, nullptr, &node_count)) return -1;
+    return static_cast<int>(node_count);
+}
+
+size_t NaryForest::treeCount() {
+    std::lock_guard<std::mutex> guard(structure_mutex);
+    return tree_count;
+}
+
+ForestMemory NaryForest::memoryUsage() {
+    std::lock_guard<std::mutex> guard(structure_mutex);
+
+    ForestMemory memory;
+    memory.trees = tree_count;
+    memory.payload = payload_bytes;
+    memory.allocated = allocated_bytes;
+
+    memory.table = sizeof(directory);
+    for (uint32_t page = 0; page < kMaxPages; page++) {
+        if (directory[page].load()) {
+            memory.table += kPageSlots * sizeof(TreeSlot);
+        }
+    }
+
+    for (size_t size : chunk_sizes) {
+        memory.reserved += size;
+    }
+    return memory;
+}
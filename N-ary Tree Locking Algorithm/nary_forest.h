@@ -0,0 +1,160 @@
+#ifndef NARY_FOREST_H
+#define NARY_FOREST_H
+
+#include "lock_protocol.h"
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+
+/**
+ * Multi-tenant Forest
+ *
+ * Hosts many independent lockable trees in one shared arena, addressed by
+ * (tree ID, node ID). Meant for one small hierarchy per tenant, where a
+ * full NaryTreeLock per tenant (hash map, per-node heap objects, names)
+ * costs far more than the lock state itself.
+ *
+ * Each tree has the same lock rules and protocol as NaryTreeLock (packed
+ * NodeState words, lock / unlock / upgradeLock); both run the shared
+ * LockProtocol. Escalation, unlock notifications and tracing are not
+ * available on forest trees.
+ *
+ * Layout:
+ * - A tree is one arena block: ForestNode[n] followed by its child lists
+ *   (int32 per non-root node)
+ * - Blocks come from per-size-class free lists, else a bump pointer into
+ *   the current arena chunk
+ * - Trees are found through a two-level slot table (16 bytes per slot);
+ *   slots never move, so lookups take no lock
+ * - A tree ID carries its slot's generation, so IDs of destroyed trees
+ *   are rejected instead of reaching a reused slot
+ *
+ * Arena memory is only returned to the system by the destructor, so a
+ * stale ID never touches unmapped memory.
+ */
+
+struct ForestNode {
+    std::atomic<uint64_t> state;  // See NodeState
+    int32_t parent;               // -1 for the root
+    uint32_t first_child;         // Children are child_ids[first_child .. next node's first_child)
+};
+
+static_assert(sizeof(ForestNode) == 16, "ForestNode must stay 16 bytes");
+
+/**
+ * Memory accounting (bytes)
+ * Per-tree overhead = (allocated - payload + table) / trees
+ */
+struct ForestMemory {
+    size_t trees = 0;
+    size_t payload = 0;    // Node and child-list bytes the trees need
+    size_t allocated = 0;  // Arena blocks handed out (payload + size-class rounding)
+    size_t table = 0;      // Slot table and directory
+    size_t reserved = 0;   // Arena chunks reserved from the system
+};
+
+class NaryForest {
+public:
+    typedef uint64_t TreeId;  // Generation (high 32 bits) and slot index (low 32 bits)
+
+private:
+    struct TreeSlot {
+        std::atomic<char*> block;
+        std::atomic<uint32_t> generation;  // Bumped when the tree is destroyed
+        uint32_t node_count;               // Next free slot index while the slot is free
+    };
+
+    static_assert(sizeof(TreeSlot) == 16, "TreeSlot must stay 16 bytes");
+
+    static constexpr uint32_t kPageSlots = 4096;
+    static constexpr uint32_t kMaxPages = 1024;  // Up to 4M trees
+    static constexpr uint32_t kNoSlot = 0xFFFFFFFFu;
+    static constexpr int kSizeClasses = 64 + 4 * 22;
+
+    // Slot table
+    std::atomic<TreeSlot*> directory[kMaxPages];
+    uint32_t slot_count;      // Slots ever handed out
+    uint32_t free_slot;       // Head of the free slot list
+    size_t tree_count;
+
+    // Arena
+    size_t chunk_bytes;
+    std::vector<char*> chunks;
+    std::vector<size_t> chunk_sizes;
+    size_t current_chunk;     // Chunk the bump pointer is in
+    size_t bump_offset;
+    char* free_blocks[kSizeClasses];  // Intrusive free lists, next pointer in the block
+
+    size_t payload_bytes;
+    size_t allocated_bytes;
+
+    std::mutex structure_mutex;  // Used only for tree creation and destruction
+
+    static size_t blockBytes(uint32_t node_count);
+    static int sizeClass(size_t bytes, size_t& class_bytes);
+
+    char* allocateBlock(size_t bytes, int size_class);
+    TreeSlot* slotAt(uint32_t index);
+    uint32_t allocateSlot();
+
+    // Resolve (tree, node); nullptr if either does not exist
+    ForestNode* findNode(TreeId tree_id, int node_id, ForestNode** nodes = nullptr,
+                         uint32_t* node_count = nullptr);
+
+public:
+    /**
+     * @param chunk_bytes: Arena growth step; larger trees get a chunk of
+     *                     their own
+     */
+    explicit NaryForest(size_t chunk_bytes = 1 << 20);
+    ~NaryForest();
+
+    NaryForest(const NaryForest&) = delete;
+    NaryForest& operator=(const NaryForest&) = delete;
+
+    /**
+     * Add a tree
+     * @param parent_ids: Parent ID for each node (-1 for the root), as for
+     *                    NaryTreeLock::buildTree
+     * @return ID of the new tree
+     * Throws std::invalid_argument unless parent_ids forms one tree.
+     *
+     * Time Complexity: O(n) to lay out the nodes; the arena block and slot
+     * come from free lists or a bump pointer in O(1)
+     */
+    TreeId createTree(const std::vector<int>& parent_ids);
+
+    /**
+     * Remove a tree and recycle its block and slot
+     * The caller must stop operating on the tree first; later calls with
+     * its ID fail.
+     * @return false if the tree does not exist
+     *
+     * Time Complexity: O(1)
+     */
+    bool destroyTree(TreeId tree_id);
+
+    /**
+     * Drop every tree at once and rewind the arena (chunks are kept)
+     * Must not run concurrently with any other call.
+     *
+     * Time Complexity: O(slots + chunks), independent of tree sizes
+     */
+    void clear();
+
+    // Same semantics as NaryTreeLock, within one tree
+    bool lock(TreeId tree_id, int node_id, int user_id);
+    bool unlock(TreeId tree_id, int node_id, int user_id);
+    bool upgradeLock(TreeId tree_id, int node_id, int user_id);
+
+    // Utility methods
+    bool isLocked(TreeId tree_id, int node_id);
+    int getLockedBy(TreeId tree_id, int node_id);
+    int nodeCount(TreeId tree_id);  // -1 if the tree does not exist
+    size_t treeCount();
+    ForestMemory memoryUsage();
+};
+
+#endif // NARY_FOREST_H
@@ -1,19 +1,35 @@
 #include "nary_tree_lock.h"
+#include "trace_recorder.h"
+#include "unlock_notifier.h"
 #include <iostream>
 #include <queue>
 #include <stack>
+#include <thread>
+#include <cmath>
+#include <algorithm>
 
 // TreeNode Implementation
 TreeNode::TreeNode(const std::string& node_name, int node_id, TreeNode* parent_node)
     : name(node_name), id(node_id), parent(parent_node),
-      locked_by(-1), locked_descendant_count(0) {}
+      state(NodeState::kUnlocked), subscriber_count(0), subtree_subscriptions(0) {}
 
 void TreeNode::addChild(TreeNode* child) {
     children.push_back(child);
 }
 
+int TreeNode::lockedBy() const {
+    uint64_t observed = state.load();
+    return NodeState::isIntent(observed) ? -1 : NodeState::owner(observed);
+}
+
+int TreeNode::lockedDescendantCount() const {
+    return NodeState::descendantCount(state.load());
+}
+
 // NaryTreeLock Implementation
-NaryTreeLock::NaryTreeLock() : root(nullptr), node_count(0) {}
+NaryTreeLock::NaryTreeLock()
+    : root(nullptr), node_count(0), trace_recorder(nullptr),
+      unlock_notifier(nullptr), next_subscription(1) {}
 
 NaryTreeLock::~NaryTreeLock() {
     // Clean up tree nodes using BFS
@@ -39,6 +55,10 @@ void NaryTreeLock::buildTree(const std::vector<std::string>& node_names,
     if (node_names.size() != parent_ids.size()) {
         throw std::invalid_argument("node_names and parent_ids must have same size");
     }
+    // Descendant counts live in 24 bits of the node's state word
+    if (node_names.size() > static_cast<size_t>(NodeState::kCountMask >> NodeState::kCountShift)) {
+        throw std::invalid_argument("tree must have at most 2^24 - 1 nodes");
+    }
 
     node_count = node_names.size();
     std::vector<TreeNode*> nodes(node_count);
@@ -73,42 +93,68 @@ TreeNode* NaryTreeLock::getNode(int node_id) {
 bool NaryTreeLock::isLocked(int node_id) {
     TreeNode* node = getNode(node_id);
     if (!node) return false;
-    return node->locked_by.load() != -1;
+    uint64_t state = node->state.load();
+    return NodeState::isLocked(state) && !NodeState::isIntent(state);
 }
 
 int NaryTreeLock::getLockedBy(int node_id) {
     TreeNode* node = getNode(node_id);
     if (!node) return -1;
-    return node->locked_by.load();
+    return node->lockedBy();
 }
 
-/**
- * Check if any ancestor is locked
- * Time Complexity: O(log N) - traverses to root
- */
-bool NaryTreeLock::hasLockedAncestor(TreeNode* node) {
-    TreeNode* curr = node->parent;
+bool NaryTreeLock::isEscalated(int node_id) {
+    TreeNode* node = getNode(node_id);
+    if (!node) return false;
+    return NodeState::isEscalated(node->state.load());
+}
 
-    while (curr != nullptr) {
-        if (curr->locked_by.load() != -1) {
-            return true;
-        }
-        curr = curr->parent;
+bool NaryTreeLock::isUpgradePending(int node_id) {
+    TreeNode* node = getNode(node_id);
+    if (!node) return false;
+    return NodeState::isIntent(node->state.load());
+}
+
+void NaryTreeLock::setTraceRecorder(TraceRecorder* recorder) {
+    trace_recorder = recorder;
+}
+
+void NaryTreeLock::setEscalationPolicy(const EscalationPolicy& policy) {
+    escalation_policy = policy;
+}
+
+void NaryTreeLock::setUnlockNotifier(UnlockNotifier* notifier) {
+    if (notifier == unlock_notifier) return;
+    unlock_notifier = notifier;
+
+    // Pending subscriptions were handed out for the previous notifier
+    for (auto& entry : node_map) {
+        TreeNode* node = entry.second;
+        std::lock_guard<std::mutex> guard(node->node_mutex);
+        node->unlock_subscriptions.clear();
+        node->subscriber_count.store(0);
+        node->subtree_subscriptions.store(0);
     }
+}
 
-    return false;
+LockStats& NaryTreeLock::threadStats() {
+    return threadLockStats();
 }
 
 /**
- * Update locked descendant count for all ancestors
- * Time Complexity: O(log N) - traverses to root
+ * Protocol hook: releasing node took ancestor's descendant count to zero
+ *
+ * A drained escalated ancestor is released. Shadow locks stop there anyway,
+ * but an ordinary lock can also sit beneath one: an escalation whose count
+ * check matched by coincidence misses a lock whose CAS lands after its
+ * re-scan, and that lock keeps its full-path counts. Otherwise the ancestor
+ * may be lockable now, so its subscribers are woken.
  */
-void NaryTreeLock::updateAncestorCount(TreeNode* node, int delta) {
-    TreeNode* curr = node->parent;
-
-    while (curr != nullptr) {
-        curr->locked_descendant_count.fetch_add(delta);
-        curr = curr->parent;
+void NaryTreeLock::ancestorDrained(TreeNode* ancestor, uint64_t prev_state, TreeNode* node) {
+    if (NodeState::isEscalated(prev_state)) {
+        releaseIfDrained(ancestor);
+    } else if (ancestor->subscriber_count.load() > 0 && isLockable(ancestor)) {
+        fireSubscriptions(ancestor, node->id);
     }
 }
 
@@ -117,38 +163,38 @@ void NaryTreeLock::updateAncestorCount(TreeNode* node, int delta) {
  * Time Complexity: O(log N)
  *
  * Algorithm:
- * 1. Check if node is already locked - O(1)
- * 2. Check if any descendant is locked - O(1) using counter
- * 3. Check if any ancestor is locked - O(log N) traverse to root
- * 4. Lock node and update ancestor counts - O(log N)
+ * 1. Read-only pre-check of node and ancestors - fails fast with no writes
+ * 2. Register the attempt on every ancestor (one fetch_add each) - O(log N)
+ * 3. Take the node with one CAS that requires "not locked and no locked
+ *    descendant" in the same word - O(1)
+ * 4. Re-check ancestors, then consider escalating the parent
+ *
+ * The node is never visibly owned before the ancestors are pinned, so no
+ * other thread can observe a half-taken lock.
  */
 bool NaryTreeLock::lock(int node_id, int user_id) {
-    TreeNode* node = getNode(node_id);
-    if (!node) return false;
-
-    // Check if already locked
-    int expected = -1;
-    if (!node->locked_by.compare_exchange_strong(expected, user_id)) {
-        // Node is already locked (by someone)
-        return false;
+    if (!trace_recorder) {
+        return lockImpl(node_id, user_id);
     }
 
-    // Check if any descendant is locked
-    if (node->locked_descendant_count.load() > 0) {
-        // Unlock and return false
-        node->locked_by.store(-1);
-        return false;
-    }
+    uint64_t start = trace_recorder->now();
+    bool result = lockImpl(node_id, user_id);
+    trace_recorder->record(TraceOp::Lock, node_id, user_id, result, start);
+    return result;
+}
 
-    // Check if any ancestor is locked
-    if (hasLockedAncestor(node)) {
-        // Unlock and return false
-        node->locked_by.store(-1);
+bool NaryTreeLock::lockImpl(int node_id, int user_id) {
+    TreeNode* node = getNode(node_id);
+    if (!node || user_id == -1) return false;
+
+    TreeNode* boundary;
+    if (!lockNode(node, user_id, boundary)) {
         return false;
     }
 
-    // Successfully locked - update ancestor counts
-    updateAncestorCount(node, 1);
+    if (!boundary && node->parent) {
+        maybeEscalate(node->parent, user_id);
+    }
 
     return true;
 }
@@ -158,25 +204,26 @@ bool NaryTreeLock::lock(int node_id, int user_id) {
  * Time Complexity: O(log N)
  *
  * Algorithm:
- * 1. Verify node is locked by this user - O(1)
- * 2. Unlock node - O(1)
- * 3. Update ancestor counts - O(log N)
+ * 1. Clear the owner if it is this user - single CAS on the packed state
+ * 2. Update ancestor counts - O(log N), or up to the escalated ancestor
+ *    for a shadow lock
  */
 bool NaryTreeLock::unlock(int node_id, int user_id) {
-    TreeNode* node = getNode(node_id);
-    if (!node) return false;
-
-    // Check if locked by this user
-    int expected = user_id;
-    if (!node->locked_by.compare_exchange_strong(expected, -1)) {
-        // Node is not locked by this user
-        return false;
+    if (!trace_recorder) {
+        return unlockImpl(node_id, user_id);
     }
 
-    // Update ancestor counts
-    updateAncestorCount(node, -1);
+    uint64_t start = trace_recorder->now();
+    bool result = unlockImpl(node_id, user_id);
+    trace_recorder->record(TraceOp::Unlock, node_id, user_id, result, start);
+    return result;
+}
 
-    return true;
+bool NaryTreeLock::unlockImpl(int node_id, int user_id) {
+    TreeNode* node = getNode(node_id);
+    if (!node || user_id == -1) return false;
+
+    return unlockNode(node, user_id);
 }
 
 /**
@@ -187,66 +234,598 @@ bool NaryTreeLock::unlock(int node_id, int user_id) {
  * 1. Check if node can be locked (not already locked, no ancestor locked)
  * 2. Check if at least one descendant is locked
  * 3. Check if all locked descendants belong to this user
- * 4. Unlock all locked descendants
- * 5. Lock the current node
+ * 4. Pin ancestors, then lock the current node with one CAS that re-checks
+ *    the descendant count
+ * 5. Unlock all locked descendants
+ *
+ * On a node escalated for this user the escalated lock simply becomes an
+ * ordinary one.
  */
 bool NaryTreeLock::upgradeLock(int node_id, int user_id) {
+    if (!trace_recorder) {
+        return upgradeLockImpl(node_id, user_id);
+    }
+
+    uint64_t start = trace_recorder->now();
+    bool result = upgradeLockImpl(node_id, user_id);
+    trace_recorder->record(TraceOp::UpgradeLock, node_id, user_id, result, start);
+    return result;
+}
+
+bool NaryTreeLock::upgradeLockImpl(int node_id, int user_id) {
     TreeNode* node = getNode(node_id);
-    if (!node) return false;
+    if (!node || user_id == -1) return false;
+
+    uint64_t observed = node->state.load();
+    if (NodeState::isEscalated(observed) && NodeState::owner(observed) == user_id) {
+        return deescalate(node, user_id);
+    }
+
+    return upgradeNode(node, user_id);
+}
+
+/**
+ * Queued upgrade
+ * Time Complexity: O(log N) to register, O(M) per drain check; the
+ * subtree is checked again only when the node's word changes
+ *
+ * Algorithm:
+ * 1. Pre-check: node unlocked, no locked ancestor, user_id holds at least
+ *    one descendant lock
+ * 2. Pin ancestors, then take the node as (owner, intent) with one CAS
+ *    that ignores the descendant count. The node now reads as locked:
+ *    new locks underneath fail their ancestor check, and attempts that
+ *    pinned it earlier fail their post-CAS validation
+ * 3. Wait until the node's count is made up of user_id's locks only
+ * 4. Clear the intent with a CAS on the count we verified (the node is
+ *    now an ordinary lock), then unlock the descendants
+ *
+ * On timeout the intent and pins are withdrawn and waiters are notified.
+ */
+bool NaryTreeLock::upgradeLockQueued(int node_id, int user_id, std::chrono::microseconds timeout) {
+    if (!trace_recorder) {
+        return upgradeLockQueuedImpl(node_id, user_id, timeout);
+    }
+
+    uint64_t start = trace_recorder->now();
+    bool result = upgradeLockQueuedImpl(node_id, user_id, timeout);
+    trace_recorder->record(TraceOp::UpgradeLockQueued, node_id, user_id, result, start);
+    return result;
+}
+
+bool NaryTreeLock::upgradeLockQueuedImpl(int node_id, int user_id, std::chrono::microseconds timeout) {
+    TreeNode* node = getNode(node_id);
+    if (!node || user_id == -1) return false;
+
+    auto deadline = std::chrono::steady_clock::now() + timeout;
 
-    // Check if node is already locked
-    if (node->locked_by.load() != -1) {
+    uint64_t observed = node->state.load();
+    if (NodeState::isLocked(observed)) {
+        if (NodeState::isEscalated(observed) && NodeState::owner(observed) == user_id) {
+            return deescalate(node, user_id);
+        }
         return false;
     }
 
-    // Check if any ancestor is locked
-    if (hasLockedAncestor(node)) {
+    TreeNode* boundary = nullptr;
+    if (hasLockedAncestor(node, user_id, &boundary)) {
         return false;
     }
 
-    // Check if there are locked descendants
-    int locked_desc_count = node->locked_descendant_count.load();
-    if (locked_desc_count == 0) {
-        return false;  // No descendants to upgrade
+    // Something of ours must be underneath to upgrade
+    std::vector<TreeNode*> locked_descendants = collectLockedDescendants(node);
+    bool holds = false;
+    for (TreeNode* desc : locked_descendants) {
+        if (NodeState::isHeldBy(desc->state.load(), user_id)) {
+            holds = true;
+        }
+    }
+    if (!holds) {
+        return false;
+    }
+
+    if (!acquireAncestors(node, user_id, boundary)) {
+        return false;
     }
 
-    // Find all locked descendants using BFS
+    // Register the intent: owner set, so the node reads as locked
+    uint64_t flags = NodeState::kIntentFlag | (boundary ? NodeState::kShadowFlag : 0);
+    observed = node->state.load();
+    while (true) {
+        if (NodeState::isLocked(observed)) {
+            releaseAncestors(node, boundary);
+            NARY_STAT(rollbacks);
+            return false;
+        }
+        if (node->state.compare_exchange_weak(observed, NodeState::withOwner(observed, user_id) | flags)) {
+            break;
+        }
+        NARY_STAT(cas_retries);
+    }
+
+    if (!validateAncestors(node, user_id)) {
+        abortUpgradeIntent(node, boundary);
+        NARY_STAT(rollbacks);
+        return false;
+    }
+
+    // Wait for other users' locks to drain; nothing new can join them.
+    // Every drained lock changes the node's count, so the subtree is only
+    // rescanned when the node's word has moved, or once per backoff period
+    // at the cap in case an attempt pinned and unpinned between two reads.
+    // Waiting yields for a few rounds, then sleeps with doubling backoff.
+    const int kYieldRounds = 16;
+    const std::chrono::microseconds kMaxBackoff(1024);
+    int idle_rounds = 0;
+    std::chrono::microseconds backoff(1);
+    uint64_t scanned = 0;
+    bool has_scanned = false;
+    while (true) {
+        observed = node->state.load();
+        bool moved = !has_scanned || observed != scanned;
+        if (moved || backoff == kMaxBackoff) {
+            if (ownsAllLockedDescendants(node, user_id, observed, locked_descendants)) {
+                if (locked_descendants.empty()) {
+                    // The user released everything meanwhile
+                    abortUpgradeIntent(node, boundary);
+                    return false;
+                }
+                if (node->state.compare_exchange_strong(observed, observed & ~NodeState::kIntentFlag)) {
+                    break;
+                }
+                continue;
+            }
+            scanned = observed;
+            has_scanned = true;
+        }
+        if (moved) {
+            idle_rounds = 0;
+            backoff = std::chrono::microseconds(1);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            abortUpgradeIntent(node, boundary);
+            return false;
+        }
+        if (idle_rounds++ < kYieldRounds) {
+            std::this_thread::yield();
+            continue;
+        }
+        auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now);
+        std::this_thread::sleep_for(std::min(backoff, remaining));
+        backoff = std::min(backoff * 2, kMaxBackoff);
+    }
+
+    releaseDescendants(locked_descendants, user_id);
+    return true;
+}
+
+/**
+ * Every lock counted on the node belongs to user_id (in-flight attempts
+ * are counted too, so they keep this false until they finish)
+ */
+bool NaryTreeLock::ownsAllLockedDescendants(TreeNode* node, int user_id, uint64_t state,
+                                            std::vector<TreeNode*>& locked_descendants) {
+    int counted = 0;
+    locked_descendants = collectLockedDescendants(node, &counted);
+    if (counted != NodeState::descendantCount(state)) {
+        return false;
+    }
+
+    for (TreeNode* desc : locked_descendants) {
+        if (!NodeState::isHeldBy(desc->state.load(), user_id)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Withdraw a registered upgrade intent and its ancestor pins
+ */
+void NaryTreeLock::abortUpgradeIntent(TreeNode* node, TreeNode* boundary) {
+    uint64_t observed = node->state.load();
+
+    while (!node->state.compare_exchange_weak(observed, NodeState::withOwner(observed, -1))) {
+        NARY_STAT(cas_retries);
+    }
+
+    releaseAncestors(node, boundary);
+    notifyReleased(node);
+}
+
+/**
+ * Find locked descendants of a node using BFS (level order)
+ * @param counted: receives how many of them are reflected in the node's
+ *                 descendant count (shadow locks beneath an escalated
+ *                 descendant are counted on that descendant only)
+ */
+std::vector<TreeNode*> NaryTreeLock::collectLockedDescendants(TreeNode* node, int* counted) {
     std::vector<TreeNode*> locked_descendants;
-    std::queue<TreeNode*> q;
-    q.push(node);
+    std::queue<std::pair<TreeNode*, bool>> q;  // (node, beneath an escalated descendant)
+    q.push({node, false});
+    int visible = 0;
 
     while (!q.empty()) {
-        TreeNode* curr = q.front();
+        TreeNode* curr = q.front().first;
+        bool covered = q.front().second;
         q.pop();
 
         for (TreeNode* child : curr->children) {
-            if (child->locked_by.load() == user_id) {
+            uint64_t state = child->state.load();
+            if (NodeState::isLocked(state)) {
                 locked_descendants.push_back(child);
+                if (!covered || !NodeState::isShadow(state)) {
+                    visible++;
+                }
             }
 
             // Continue BFS even if child is locked (might have locked descendants)
-            q.push(child);
+            q.push({child, covered || NodeState::isEscalated(state)});
         }
     }
 
-    // Verify all locked descendants belong to this user
-    if ((int)locked_descendants.size() != locked_desc_count) {
-        return false;  // Some descendants locked by other users
+    if (counted) *counted = visible;
+    return locked_descendants;
+}
+
+/**
+ * Escalation threshold for a parent node (0 when escalation is off)
+ */
+int NaryTreeLock::escalationThreshold(TreeNode* node) {
+    int threshold = escalation_policy.max_locked_descendants;
+
+    if (escalation_policy.max_child_fraction > 0.0) {
+        int by_fraction = static_cast<int>(
+            std::ceil(escalation_policy.max_child_fraction * node->children.size()));
+        by_fraction = std::max(by_fraction, 1);
+        threshold = threshold > 0 ? std::min(threshold, by_fraction) : by_fraction;
+    }
+
+    return threshold;
+}
+
+/**
+ * Try to escalate a parent whose count just reached the threshold, or a
+ * further multiple of it (so a failed attempt is not repeated every lock)
+ */
+void NaryTreeLock::maybeEscalate(TreeNode* node, int user_id) {
+    if (escalation_policy.max_locked_descendants <= 0 && escalation_policy.max_child_fraction <= 0.0) {
+        return;
+    }
+
+    int threshold = escalationThreshold(node);
+    if (threshold <= 0) {
+        return;
     }
 
-    // Unlock all descendants
+    uint64_t observed = node->state.load();
+    int count = NodeState::descendantCount(observed);
+
+    if (NodeState::isLocked(observed) || count < threshold || (count - threshold) % threshold != 0) {
+        return;
+    }
+
+    escalate(node, user_id);
+}
+
+/**
+ * Escalate: lock a node on user_id's behalf while keeping the user's
+ * descendant locks, and stop counting those locks above it
+ * Time Complexity: O(S + log N) where S is the subtree size
+ *
+ * Algorithm:
+ * 1. Node unlocked, no locked ancestor (escalations do not nest) and every
+ *    locked descendant owned by the user
+ * 2. Pin ancestors for the escalated lock, as lock() does, so the node is
+ *    never visibly owned without its counts in place
+ * 3. CAS the node to (owner, escalated, pending) with the verified count;
+ *    while pending, new locks underneath are not absorbed
+ * 4. Re-scan for foreign locks
+ * 5. Turn each existing descendant lock into a shadow lock and drop its
+ *    count above the node - one RMW walk per lock, once
+ * 6. Clear pending (or release right away if everything drained)
+ */
+bool NaryTreeLock::escalate(TreeNode* node, int user_id) {
+    uint64_t observed = node->state.load();
+    int count = NodeState::descendantCount(observed);
+    if (NodeState::isLocked(observed) || count == 0) {
+        return false;
+    }
+
+    if (hasLockedAncestor(node)) {
+        return false;
+    }
+
+    int counted = 0;
+    std::vector<TreeNode*> locked_descendants = collectLockedDescendants(node, &counted);
+    if (counted != count) {
+        return false;
+    }
     for (TreeNode* desc : locked_descendants) {
-        desc->locked_by.store(-1);
-        updateAncestorCount(desc, -1);
+        uint64_t state = desc->state.load();
+        if (!NodeState::isHeldBy(state, user_id) || NodeState::isPending(state)) {
+            return false;
+        }
+    }
+
+    TreeNode* boundary = nullptr;
+    if (!acquireAncestors(node, user_id, boundary)) {
+        return false;
+    }
+    if (boundary) {
+        // An ancestor was escalated meanwhile; do not nest
+        releaseAncestors(node, boundary);
+        NARY_STAT(rollbacks);
+        return false;
+    }
+
+    uint64_t desired = NodeState::withOwner(observed, user_id) |
+                       NodeState::kEscalatedFlag | NodeState::kPendingFlag;
+    if (!node->state.compare_exchange_strong(observed, desired)) {
+        releaseAncestors(node, nullptr);
+        NARY_STAT(rollbacks);
+        return false;
     }
 
-    // Lock current node
-    node->locked_by.store(user_id);
-    updateAncestorCount(node, 1);
+    // Same re-scan as upgradeLock
+    locked_descendants = collectLockedDescendants(node);
+    for (TreeNode* desc : locked_descendants) {
+        if (!NodeState::isHeldBy(desc->state.load(), user_id)) {
+            abortEscalation(node);
+            NARY_STAT(rollbacks);
+            return false;
+        }
+    }
 
+    // Convert the locks whose nearest escalated ancestor is now this node
+    for (TreeNode* desc : locked_descendants) {
+        uint64_t state = desc->state.load();
+        while (NodeState::owner(state) == user_id && !NodeState::isShadow(state) &&
+               !NodeState::isPending(state) && escalationBoundary(desc) == node) {
+            if (desc->state.compare_exchange_weak(state, state | NodeState::kShadowFlag)) {
+                updateAncestorCount(node, -1);
+                break;
+            }
+            NARY_STAT(cas_retries);
+        }
+    }
+
+    // Open the escalation for new locks
+    observed = node->state.load();
+    while (true) {
+        if (NodeState::descendantCount(observed) == 0) {
+            // Everything was unlocked meanwhile
+            if (node->state.compare_exchange_weak(observed, NodeState::withOwner(observed, -1))) {
+                releaseAncestors(node, nullptr);
+                notifyReleased(node);
+                break;
+            }
+        } else if (node->state.compare_exchange_weak(observed, observed & ~NodeState::kPendingFlag)) {
+            break;
+        }
+        NARY_STAT(cas_retries);
+    }
+
+    NARY_STAT(escalations);
     return true;
 }
 
+/**
+ * Undo an escalation that is still pending (pinned, no shadow locks yet)
+ */
+void NaryTreeLock::abortEscalation(TreeNode* node) {
+    uint64_t observed = node->state.load();
+
+    while (!node->state.compare_exchange_weak(observed, NodeState::withOwner(observed, -1))) {
+        NARY_STAT(cas_retries);
+    }
+
+    releaseAncestors(node, nullptr);
+    notifyReleased(node);
+}
+
+/**
+ * Release an escalated lock once nothing underneath is counted on it
+ */
+void NaryTreeLock::releaseIfDrained(TreeNode* node) {
+    uint64_t observed = node->state.load();
+
+    while (NodeState::isEscalated(observed) && !NodeState::isPending(observed) &&
+           NodeState::descendantCount(observed) == 0) {
+        if (node->state.compare_exchange_weak(observed, NodeState::withOwner(observed, -1))) {
+            releaseAncestors(node, NodeState::isShadow(observed) ? escalationBoundary(node) : nullptr);
+            notifyReleased(node);
+            return;
+        }
+        NARY_STAT(cas_retries);
+    }
+}
+
+/**
+ * Turn an escalated lock into an ordinary lock held by its user
+ * Time Complexity: O(S + M log N)
+ *
+ * Marks the node pending (no auto-release, nothing new absorbed), unlocks
+ * every descendant and clears the flags once the count is zero. Gives up
+ * if the user keeps locking beneath a nested escalation.
+ */
+bool NaryTreeLock::deescalate(TreeNode* node, int user_id) {
+    const int kMaxDrainRounds = 64;
+
+    uint64_t observed = node->state.load();
+    while (true) {
+        if (NodeState::owner(observed) != user_id || !NodeState::isEscalated(observed) ||
+            NodeState::isPending(observed)) {
+            return false;
+        }
+        if (node->state.compare_exchange_weak(observed, observed | NodeState::kPendingFlag)) {
+            break;
+        }
+        NARY_STAT(cas_retries);
+    }
+
+    for (int round = 0; round < kMaxDrainRounds; round++) {
+        releaseDescendants(collectLockedDescendants(node), user_id);
+
+        observed = node->state.load();
+        while (NodeState::descendantCount(observed) == 0) {
+            uint64_t cleared = observed & ~(NodeState::kEscalatedFlag | NodeState::kPendingFlag);
+            if (node->state.compare_exchange_weak(observed, cleared)) {
+                return true;
+            }
+            NARY_STAT(cas_retries);
+        }
+
+        std::this_thread::yield();
+    }
+
+    // Leave it escalated
+    observed = node->state.load();
+    while (!node->state.compare_exchange_weak(observed, observed & ~NodeState::kPendingFlag)) {
+        NARY_STAT(cas_retries);
+    }
+    releaseIfDrained(node);
+    return false;
+}
+
+/**
+ * Subscribe to a node becoming lockable
+ * Time Complexity: O(log N)
+ *
+ * Algorithm:
+ * 1. Register the ID on the node, then count it on the node and every
+ *    ancestor (bottom-up) so releasing threads can find it
+ * 2. Check whether the node is lockable already and fire if so
+ *
+ * Registering before checking closes the race with a concurrent release:
+ * either the release sees the subscription or the check sees the release.
+ */
+uint64_t NaryTreeLock::subscribeUnlock(int node_id) {
+    TreeNode* node = getNode(node_id);
+    if (!node || !unlock_notifier) return 0;
+
+    uint64_t subscription_id = (next_subscription.fetch_add(1) << 32) | static_cast<uint32_t>(node_id);
+
+    {
+        std::lock_guard<std::mutex> guard(node->node_mutex);
+        node->unlock_subscriptions.push_back(subscription_id);
+        node->subscriber_count.fetch_add(1);
+    }
+    adjustSubtreeSubscriptions(node, 1);
+
+    if (isLockable(node)) {
+        fireSubscriptions(node, -1);
+    }
+
+    return subscription_id;
+}
+
+bool NaryTreeLock::unsubscribeUnlock(uint64_t subscription_id) {
+    // The low half of the ID is the node
+    TreeNode* node = getNode(static_cast<int>(subscription_id & 0xFFFFFFFFull));
+    if (!node) return false;
+
+    {
+        std::lock_guard<std::mutex> guard(node->node_mutex);
+        auto it = std::find(node->unlock_subscriptions.begin(), node->unlock_subscriptions.end(),
+                            subscription_id);
+        if (it == node->unlock_subscriptions.end()) {
+            return false;  // Fired or cancelled already
+        }
+        node->unlock_subscriptions.erase(it);
+        node->subscriber_count.fetch_sub(1);
+    }
+    adjustSubtreeSubscriptions(node, -1);
+
+    return true;
+}
+
+/**
+ * Unlocked, no locked descendant and no locked ancestor (an escalated
+ * ancestor counts as locked: it only admits its own user)
+ */
+bool NaryTreeLock::isLockable(TreeNode* node) {
+    uint64_t state = node->state.load();
+    return !NodeState::isLocked(state) && NodeState::descendantCount(state) == 0 &&
+           !hasLockedAncestor(node);
+}
+
+void NaryTreeLock::adjustSubtreeSubscriptions(TreeNode* node, int delta) {
+    for (TreeNode* curr = node; curr != nullptr; curr = curr->parent) {
+        curr->subtree_subscriptions.fetch_add(delta);
+    }
+}
+
+/**
+ * Publish an event for every subscription on a node and drop them (each
+ * fires once; whoever empties the list under the mutex publishes)
+ */
+void NaryTreeLock::fireSubscriptions(TreeNode* node, int released_id) {
+    UnlockNotifier* notifier = unlock_notifier;
+    if (!notifier) return;
+
+    std::vector<uint64_t> fired;
+    {
+        std::lock_guard<std::mutex> guard(node->node_mutex);
+        fired.swap(node->unlock_subscriptions);
+        node->subscriber_count.fetch_sub(static_cast<int>(fired.size()));
+    }
+    if (fired.empty()) return;
+
+    adjustSubtreeSubscriptions(node, -static_cast<int>(fired.size()));
+
+    uint64_t timestamp = UnlockNotifier::now();
+    for (uint64_t subscription_id : fired) {
+        notifier->publish({subscription_id, node->id, released_id, timestamp});
+    }
+}
+
+/**
+ * Wake subscribers a released lock was blocking: the node itself and
+ * descendants that are now lockable
+ * Time Complexity: O(1) with no subscriptions in the subtree, otherwise
+ * O(log N + S) where S is the number of subscribed nodes in the subtree
+ *
+ * Ancestors are handled by updateAncestorCount when their count drops to
+ * zero. The walk only enters children with subscriptions and stops at
+ * locked nodes, which still block everything below them.
+ */
+void NaryTreeLock::notifyReleased(TreeNode* node) {
+    if (!unlock_notifier || node->subtree_subscriptions.load() == 0) {
+        return;
+    }
+
+    // Still covered by a locked or escalated ancestor: nothing below is free
+    if (hasLockedAncestor(node)) {
+        return;
+    }
+
+    std::stack<TreeNode*> pending;
+    pending.push(node);
+
+    while (!pending.empty()) {
+        TreeNode* curr = pending.top();
+        pending.pop();
+
+        uint64_t state = curr->state.load();
+        if (NodeState::isLocked(state)) {
+            continue;
+        }
+
+        if (NodeState::descendantCount(state) == 0 && curr->subscriber_count.load() > 0) {
+            fireSubscriptions(curr, node->id);
+        }
+
+        for (TreeNode* child : curr->children) {
+            if (child->subtree_subscriptions.load() > 0) {
+                pending.push(child);
+            }
+        }
+    }
+}
+
 void NaryTreeLock::printTree() {
     if (!root) {
         std::cout << "Tree is empty" << std::endl;
@@ -268,12 +847,15 @@ void NaryTreeLock::printTreeHelper(TreeNode* node, int depth) {
     // Print node info
     std::cout << node->name << " (ID: " << node->id << ")";
 
-    int locked = node->locked_by.load();
+    uint64_t state = node->state.load();
+    int locked = NodeState::owner(state);
     if (locked != -1) {
-        std::cout << " [LOCKED by User " << locked << "]";
+        std::cout << " [LOCKED by User " << locked
+                  << (NodeState::isEscalated(state) ? ", escalated" : "")
+                  << (NodeState::isIntent(state) ? ", upgrade pending" : "") << "]";
     }
 
-    int desc_count = node->locked_descendant_count.load();
+    int desc_count = NodeState::descendantCount(state);
     if (desc_count > 0) {
         std::cout << " [" << desc_count << " locked descendants]";
     }
@@ -1,12 +1,18 @@
 #ifndef NARY_TREE_LOCK_H
 #define NARY_TREE_LOCK_H
 
+#include "lock_protocol.h"
 #include <vector>
 #include <string>
 #include <atomic>
+#include <cstdint>
 #include <memory>
 #include <unordered_map>
 #include <mutex>
+#include <chrono>
+
+class TraceRecorder;
+class UnlockNotifier;
 
 /**
  * N-ary Tree Locking Algorithm
@@ -22,7 +28,31 @@
  * - Track locked descendant count at each node
  * - Only traverse to root for ancestor checking (O(height))
  * - Use atomic operations for thread safety
+ * - Pack owner, descendant count and version into one word so every
+ *   lock decision is a single CAS or RMW
+ */
+
+/**
+ * Lock escalation policy
+ *
+ * After a successful lock, if the parent's locked descendant count reaches
+ * the threshold (and again at every further multiple of it), the engine
+ * tries to convert the user's locks under that parent into one escalated
+ * lock on the parent. Escalation only happens when every lock under the
+ * parent belongs to that user.
+ *
+ * While escalated:
+ * - The parent reports as locked by the user; other users are blocked
+ * - The user's further locks under the parent stop their ancestor walk at
+ *   the parent instead of the root
+ * - unlock() of the covered nodes works as before; the escalated lock is
+ *   released automatically when the last one is unlocked
+ * - upgradeLock() on the parent turns it into an ordinary lock
  */
+struct EscalationPolicy {
+    int max_locked_descendants = 0;   // Escalate at this many (0 = off)
+    double max_child_fraction = 0.0;  // Or at this fraction of the parent's children (0 = off)
+};
 
 class TreeNode {
 public:
@@ -31,27 +61,67 @@ public:
     TreeNode* parent;
     std::vector<TreeNode*> children;
 
-    // Lock state
-    std::atomic<int> locked_by;          // User ID who locked this node (-1 if unlocked)
-    std::atomic<int> locked_descendant_count;  // Count of locked descendants
+    // Lock state: owner, locked descendant count and version (see NodeState)
+    std::atomic<uint64_t> state;
 
     // Thread safety
-    std::mutex node_mutex;  // Used only for structural modifications
+    std::mutex node_mutex;  // Used only for structural modifications and subscriptions
+
+    // Unlock subscriptions (see NaryTreeLock::subscribeUnlock)
+    std::vector<uint64_t> unlock_subscriptions;  // Guarded by node_mutex
+    std::atomic<int> subscriber_count;           // Size of the above, read without the mutex
+    std::atomic<int> subtree_subscriptions;      // Subscriptions on this node and its descendants
 
     TreeNode(const std::string& node_name, int node_id, TreeNode* parent_node = nullptr);
 
     void addChild(TreeNode* child);
+
+    int lockedBy() const;                // User ID who locked this node (-1 if unlocked or
+                                         // only reserved by a queued upgrade)
+    int lockedDescendantCount() const;   // Count of locked descendants
 };
 
-class NaryTreeLock {
+class NaryTreeLock : private LockProtocol<NaryTreeLock, TreeNode> {
 private:
+    friend class LockBatch;  // Shares ancestor updates across queued calls
+    friend class LockProtocol<NaryTreeLock, TreeNode>;
+
     TreeNode* root;
     std::unordered_map<int, TreeNode*> node_map;  // Fast lookup by ID
     int node_count;
-
-    // Helper methods
-    bool hasLockedAncestor(TreeNode* node);
-    void updateAncestorCount(TreeNode* node, int delta);
+    TraceRecorder* trace_recorder;  // Optional, not owned
+    EscalationPolicy escalation_policy;
+    UnlockNotifier* unlock_notifier;  // Optional, not owned
+    std::atomic<uint64_t> next_subscription;
+
+    // Node and ancestor access for LockProtocol
+    TreeNode* parentOf(TreeNode* node) { return node->parent; }
+    std::vector<TreeNode*> collectLockedDescendants(TreeNode* node, int* counted = nullptr);
+    void ancestorDrained(TreeNode* ancestor, uint64_t prev_state, TreeNode* node);
+
+    // Escalation
+    int escalationThreshold(TreeNode* node);
+    void maybeEscalate(TreeNode* node, int user_id);
+    bool escalate(TreeNode* node, int user_id);
+    void abortEscalation(TreeNode* node);
+    void releaseIfDrained(TreeNode* node);
+    bool deescalate(TreeNode* node, int user_id);
+
+    // Queued upgrade
+    bool ownsAllLockedDescendants(TreeNode* node, int user_id, uint64_t state,
+                                  std::vector<TreeNode*>& locked_descendants);
+    void abortUpgradeIntent(TreeNode* node, TreeNode* boundary);
+
+    // Unlock notification
+    bool isLockable(TreeNode* node);
+    void adjustSubtreeSubscriptions(TreeNode* node, int delta);
+    void fireSubscriptions(TreeNode* node, int released_id);
+    void notifyReleased(TreeNode* node);
+
+    bool lockImpl(int node_id, int user_id);
+    bool unlockImpl(int node_id, int user_id);
+    bool upgradeLockImpl(int node_id, int user_id);
+    bool upgradeLockQueuedImpl(int node_id, int user_id, std::chrono::microseconds timeout);
 
 public:
     NaryTreeLock();
@@ -61,6 +131,8 @@ public:
      * Build tree from parent array representation
      * @param node_names: Names of nodes
      * @param parent_ids: Parent ID for each node (-1 for root)
+     * Throws std::invalid_argument if the sizes differ or there are more
+     * than 2^24 - 1 nodes (the width of the descendant count).
      */
     void buildTree(const std::vector<std::string>& node_names,
                     const std::vector<int>& parent_ids);
@@ -95,12 +167,84 @@ public:
      */
     bool upgradeLock(int node_id, int user_id);
 
+    /**
+     * Queued upgrade: reserve the node, then wait for other users'
+     * descendant locks to drain
+     * @param node_id: ID of the node to upgrade
+     * @param user_id: ID of the user requesting the upgrade
+     * @param timeout: Longest time to wait for the drain
+     * @return true if upgrade successful, false otherwise
+     *
+     * upgradeLock() fails whenever another user holds a descendant lock at
+     * the moment it looks, so under sibling churn it can fail forever. This
+     * variant registers an upgrade intent on the node first: from then on
+     * new locks underneath are rejected, as if the node were locked, and
+     * existing holders can only leave. The upgrade completes as soon as
+     * every remaining descendant lock belongs to user_id. On timeout the
+     * intent is withdrawn and nothing changes.
+     *
+     * Fails without waiting if the node or an ancestor is locked or user_id
+     * holds no descendant lock.
+     *
+     * Time Complexity: O(M + log N) per drain check, M locked descendants
+     */
+    bool upgradeLockQueued(int node_id, int user_id, std::chrono::microseconds timeout);
+
+    /**
+     * Record every lock/unlock/upgradeLock call into a trace
+     * @param recorder: Recorder to use, or nullptr to stop recording.
+     *                  Not owned; set it before concurrent use begins.
+     */
+    void setTraceRecorder(TraceRecorder* recorder);
+
+    /**
+     * Configure automatic lock escalation (off by default)
+     * Set it before concurrent use begins.
+     */
+    void setEscalationPolicy(const EscalationPolicy& policy);
+
+    /**
+     * Deliver unlock events to a notifier (off by default)
+     * @param notifier: Notifier to use, or nullptr to stop. Not owned; set
+     *                  it before concurrent use begins.
+     * Changing the notifier drops every pending subscription.
+     */
+    void setUnlockNotifier(UnlockNotifier* notifier);
+
+    /**
+     * Ask to be told once when a node becomes lockable
+     * @param node_id: Node the scheduler is waiting for
+     * @return subscription ID (never 0), or 0 if the node does not exist or
+     *         no notifier is set
+     *
+     * The subscription fires exactly once, when the release of the node, an
+     * ancestor or its last locked descendant leaves it unlocked with no
+     * locked ancestor or descendant. A node that is already lockable fires
+     * immediately. Another user may still win the race for the lock, in
+     * which case the scheduler subscribes again.
+     *
+     * Time Complexity: O(log N)
+     */
+    uint64_t subscribeUnlock(int node_id);
+
+    /**
+     * Cancel a subscription that has not fired
+     * @return true if it was still pending
+     */
+    bool unsubscribeUnlock(uint64_t subscription_id);
+
     // Utility methods
     TreeNode* getNode(int node_id);
     bool isLocked(int node_id);
     int getLockedBy(int node_id);
+    bool isEscalated(int node_id);
+    bool isUpgradePending(int node_id);  // Queued upgrade registered, still draining
     void printTree();
     void printTreeHelper(TreeNode* node, int depth);
+
+    // Contention counters of the calling thread (all zero unless built
+    // with NARY_TREE_LOCK_STATS)
+    static LockStats& threadStats();
 };
 
 #endif // NARY_TREE_LOCK_H
@@ -0,0 +1,305 @@
+#include "trace_recorder.h"
+#include "nary_tree_lock.h"
+#include <stdexcept>
+#include <cstring>
+
+namespace {
+
+const char kTraceMagic[4] = {'N', 'T', 'L', 'T'};
+const uint32_t kTraceVersion = 2;  // 2: gap records for dropped calls
+
+std::atomic<uint64_t> next_recorder_id(1);
+
+template <typename T>
+void writeValue(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+bool readValue(std::ifstream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+// Limits on values read from a trace file
+const uint32_t kMaxTraceNodes = NodeState::kCountMask >> NodeState::kCountShift;
+const uint32_t kMaxTraceThreads = 1 << 16;
+
+/**
+ * Reject a header that buildTree could not turn into one tree: exactly
+ * one root, parents in range, and every node reaching the root (no cycle)
+ */
+void validateShape(const std::vector<int>& parent_ids, const std::string& path) {
+    int node_count = static_cast<int>(parent_ids.size());
+    int roots = 0;
+    for (int i = 0; i < node_count; i++) {
+        int parent_id = parent_ids[i];
+        if (parent_id == -1) {
+            roots++;
+        } else if (parent_id < 0 || parent_id >= node_count || parent_id == i) {
+            throw std::runtime_error("invalid parent in trace header: " + path);
+        }
+    }
+    if (roots != 1) {
+        throw std::runtime_error("trace header does not have exactly one root: " + path);
+    }
+
+    // 0 = unvisited, 1 = on the current walk, 2 = reaches the root
+    std::vector<uint8_t> mark(node_count, 0);
+    std::vector<int> walk;
+    for (int i = 0; i < node_count; i++) {
+        int curr = i;
+        walk.clear();
+        while (curr != -1 && mark[curr] == 0) {
+            mark[curr] = 1;
+            walk.push_back(curr);
+            curr = parent_ids[curr];
+        }
+        if (curr != -1 && mark[curr] == 1) {
+            throw std::runtime_error("parent cycle in trace header: " + path);
+        }
+        for (int node : walk) {
+            mark[node] = 2;
+        }
+    }
+}
+
+}  // namespace
+
+// TraceRing Implementation
+TraceRing::TraceRing(size_t capacity) : head(0), lost(0), tail(0) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    buffer.resize(size);
+    mask = size - 1;
+}
+
+bool TraceRing::push(const TraceRecord& record, bool& high_water) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    uint64_t used = h - tail.load(std::memory_order_acquire);
+    uint64_t missing = lost.load(std::memory_order_relaxed);
+
+    // Room for the record, and for the gap record owed before it
+    if (used + (missing > 0 ? 2 : 1) > mask + 1) {
+        lost.store(missing + 1, std::memory_order_relaxed);
+        return false;  // Full
+    }
+
+    if (missing > 0) {
+        buffer[h & mask] = TraceRecord::gap(missing);
+        lost.store(0, std::memory_order_relaxed);
+        h++;
+    }
+    buffer[h & mask] = record;
+    head.store(h + 1, std::memory_order_release);
+
+    uint64_t half = (mask + 1) / 2;
+    high_water = used < half && used + (missing > 0 ? 2 : 1) >= half;
+    return true;
+}
+
+size_t TraceRing::drain(std::vector<TraceRecord>& out) {
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    uint64_t h = head.load(std::memory_order_acquire);
+
+    for (uint64_t i = t; i < h; i++) {
+        out.push_back(buffer[i & mask]);
+    }
+
+    tail.store(h, std::memory_order_release);
+    return h - t;
+}
+
+// TraceRecorder Implementation
+TraceRecorder::TraceRecorder(const std::string& path, const std::vector<int>& parent_ids,
+                             size_t capacity)
+    : out(path, std::ios::binary | std::ios::trunc),
+      start_time(std::chrono::steady_clock::now()),
+      ring_capacity(capacity),
+      recorder_id(next_recorder_id.fetch_add(1)),
+      dropped(0), stopping(false), drain_requested(false) {
+    if (!out) {
+        throw std::runtime_error("cannot open trace file: " + path);
+    }
+
+    out.write(kTraceMagic, sizeof(kTraceMagic));
+    writeValue(out, kTraceVersion);
+    writeValue(out, static_cast<uint32_t>(parent_ids.size()));
+    for (int parent_id : parent_ids) {
+        writeValue(out, static_cast<int32_t>(parent_id));
+    }
+
+    writer = std::thread(&TraceRecorder::writerLoop, this);
+}
+
+TraceRecorder::~TraceRecorder() {
+    stopping.store(true);
+    wake.notify_one();
+    writer.join();
+    drainAll(true);
+    out.flush();
+}
+
+uint64_t TraceRecorder::now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_time).count();
+}
+
+/**
+ * Find (or register) the calling thread's ring for this recorder
+ * The common case is a single thread_local comparison.
+ */
+TraceRing* TraceRecorder::threadRing() {
+    struct CacheEntry {
+        uint64_t recorder_id;
+        TraceRing* ring;
+    };
+    thread_local CacheEntry last = {0, nullptr};
+    thread_local std::vector<CacheEntry> known;
+
+    if (last.recorder_id == recorder_id) {
+        return last.ring;
+    }
+
+    for (const CacheEntry& entry : known) {
+        if (entry.recorder_id == recorder_id) {
+            last = entry;
+            return last.ring;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(rings_mutex);
+    rings.push_back(std::make_unique<TraceRing>(ring_capacity));
+    last = {recorder_id, rings.back().get()};
+    known.push_back(last);
+    return last.ring;
+}
+
+void TraceRecorder::record(TraceOp op, int node_id, int user_id, bool result, uint64_t timestamp_ns) {
+    TraceRecord rec = TraceRecord::make(op, node_id, user_id, result, timestamp_ns);
+    bool high_water = false;
+    if (!threadRing()->push(rec, high_water)) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+    } else if (high_water) {
+        drain_requested.store(true);
+        wake.notify_one();
+    }
+}
+
+void TraceRecorder::writerLoop() {
+    while (!stopping.load()) {
+        drainAll(false);
+
+        // Sleep up to 1 ms, less if a ring reaches its high-water mark
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        wake.wait_for(lock, std::chrono::milliseconds(1), [this]() {
+            return drain_requested.load() || stopping.load();
+        });
+        drain_requested.store(false);
+    }
+}
+
+/**
+ * Write one chunk per ring that has pending records
+ * @param final: recording has stopped; also write a gap record for losses
+ *               no later push could report
+ */
+void TraceRecorder::drainAll(bool final) {
+    std::vector<TraceRecord> pending;
+    std::lock_guard<std::mutex> guard(rings_mutex);
+
+    for (size_t slot = 0; slot < rings.size(); slot++) {
+        pending.clear();
+        rings[slot]->drain(pending);
+        if (final && rings[slot]->unreportedLoss() > 0) {
+            pending.push_back(TraceRecord::gap(rings[slot]->unreportedLoss()));
+        }
+        if (pending.empty()) {
+            continue;
+        }
+
+        writeValue(out, static_cast<uint32_t>(slot));
+        writeValue(out, static_cast<uint32_t>(pending.size()));
+        out.write(reinterpret_cast<const char*>(pending.data()),
+                  pending.size() * sizeof(TraceRecord));
+    }
+}
+
+// TraceReader Implementation
+TraceReader::TraceReader(const std::string& path)
+    : record_count(0), dropped_records(0), gap_count(0) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("cannot open trace file: " + path);
+    }
+
+    char magic[4];
+    uint32_t version = 0;
+    uint32_t node_count = 0;
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, kTraceMagic, sizeof(magic)) != 0 ||
+        !readValue(in, version) || version < 1 || version > kTraceVersion ||
+        !readValue(in, node_count)) {
+        throw std::runtime_error("not a tree lock trace: " + path);
+    }
+
+    // Everything below is sized from the file, so check it against what
+    // the file can actually hold before allocating
+    std::streamoff data_start = in.tellg();
+    in.seekg(0, std::ios::end);
+    uint64_t remaining = static_cast<uint64_t>(in.tellg() - data_start);
+    in.seekg(data_start);
+
+    if (node_count == 0 || node_count > kMaxTraceNodes || node_count > remaining / sizeof(int32_t)) {
+        throw std::runtime_error("bad node count in trace header: " + path);
+    }
+    remaining -= node_count * sizeof(int32_t);
+
+    parent_ids.resize(node_count);
+    for (uint32_t i = 0; i < node_count; i++) {
+        int32_t parent_id;
+        if (!readValue(in, parent_id)) {
+            throw std::runtime_error("truncated trace header: " + path);
+        }
+        parent_ids[i] = parent_id;
+    }
+    validateShape(parent_ids, path);
+
+    uint32_t slot;
+    while (readValue(in, slot)) {
+        uint32_t count;
+        if (!readValue(in, count)) {
+            throw std::runtime_error("truncated trace chunk: " + path);
+        }
+        remaining -= std::min<uint64_t>(remaining, 2 * sizeof(uint32_t));
+
+        if (slot >= kMaxTraceThreads) {
+            throw std::runtime_error("bad thread slot in trace chunk: " + path);
+        }
+        if (count > remaining / sizeof(TraceRecord)) {
+            throw std::runtime_error("truncated trace chunk: " + path);
+        }
+        remaining -= count * sizeof(TraceRecord);
+
+        if (slot >= thread_records.size()) {
+            thread_records.resize(slot + 1);
+        }
+
+        std::vector<TraceRecord>& records = thread_records[slot];
+        size_t offset = records.size();
+        records.resize(offset + count);
+        if (!in.read(reinterpret_cast<char*>(records.data() + offset), count * sizeof(TraceRecord))) {
+            throw std::runtime_error("truncated trace chunk: " + path);
+        }
+
+        // Take the gap records out, keeping their totals
+        auto is_gap = [this](const TraceRecord& record) {
+            if (!record.isGap()) return false;
+            dropped_records += static_cast<uint32_t>(record.node_id);
+            gap_count++;
+            return true;
+        };
+        records.erase(std::remove_if(records.begin() + offset, records.end(), is_gap), records.end());
+        record_count += records.size() - offset;
+    }
+}
@@ -0,0 +1,178 @@
+#ifndef TRACE_RECORDER_H
+#define TRACE_RECORDER_H
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <fstream>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <algorithm>
+
+/**
+ * Lock Operation Trace Capture
+ *
+ * Records every lock/unlock/upgradeLock call of a NaryTreeLock into a
+ * compact binary trace that trace_replay can rebuild and replay.
+ *
+ * Design:
+ * - Each calling thread appends to its own lock-free SPSC ring buffer
+ * - A background writer thread drains the rings into the trace file
+ * - The writer drains every millisecond, and at once when a ring gets
+ *   half full
+ * - Records are 16 bytes; a full ring drops records (never blocks). The
+ *   loss is written into that thread's stream as a gap record, so readers
+ *   know the trace is incomplete and where.
+ *
+ * File format (native endianness):
+ *   header: "NTLT", uint32 version, uint32 node_count, int32 parent_ids[node_count]
+ *   chunks: uint32 thread_slot, uint32 record_count, TraceRecord[record_count]
+ */
+
+enum class TraceOp : uint8_t {
+    Lock = 0,
+    Unlock = 1,
+    UpgradeLock = 2,
+    UpgradeLockQueued = 3
+};
+
+struct TraceRecord {
+    static constexpr uint64_t kTimestampMask = (1ull << 60) - 1;
+    static constexpr int kOpShift = 60;
+    static constexpr uint64_t kResultBit = 1ull << 62;
+    static constexpr uint64_t kGapBit = 1ull << 63;
+
+    uint64_t timestamp_and_op;  // bits 0..59: ns since recorder start, 60..61: op, 62: result,
+                                // 63: gap record (node_id = records lost at this point)
+    int32_t node_id;
+    int32_t user_id;
+
+    static TraceRecord make(TraceOp op, int node_id, int user_id, bool result, uint64_t timestamp_ns) {
+        TraceRecord record;
+        record.timestamp_and_op = (timestamp_ns & kTimestampMask) |
+                                  (static_cast<uint64_t>(op) << kOpShift) |
+                                  (result ? kResultBit : 0);
+        record.node_id = node_id;
+        record.user_id = user_id;
+        return record;
+    }
+
+    static TraceRecord gap(uint64_t lost) {
+        TraceRecord record;
+        record.timestamp_and_op = kGapBit;
+        record.node_id = static_cast<int32_t>(std::min<uint64_t>(lost, INT32_MAX));
+        record.user_id = -1;
+        return record;
+    }
+
+    bool isGap() const { return (timestamp_and_op & kGapBit) != 0; }
+    uint64_t timestamp() const { return timestamp_and_op & kTimestampMask; }
+    TraceOp op() const { return static_cast<TraceOp>((timestamp_and_op >> kOpShift) & 0x3); }
+    bool result() const { return (timestamp_and_op & kResultBit) != 0; }
+};
+
+static_assert(sizeof(TraceRecord) == 16, "TraceRecord must stay 16 bytes");
+
+/**
+ * Single-producer single-consumer ring of trace records
+ * Producer: the thread calling into the tree. Consumer: the writer thread.
+ */
+class TraceRing {
+private:
+    std::vector<TraceRecord> buffer;
+    uint64_t mask;
+
+    alignas(64) std::atomic<uint64_t> head;  // Next slot to write (producer)
+    std::atomic<uint64_t> lost;              // Dropped since the last gap record (producer)
+    alignas(64) std::atomic<uint64_t> tail;  // Next slot to read (consumer)
+
+public:
+    explicit TraceRing(size_t capacity);  // Rounded up to a power of two
+
+    /**
+     * Append a record, preceded by a gap record if earlier ones were lost
+     * @param high_water: set to true when this push fills half the ring
+     * @return false if the ring is full (the record is counted as lost)
+     */
+    bool push(const TraceRecord& record, bool& high_water);
+    size_t drain(std::vector<TraceRecord>& out);
+
+    // Records lost with no gap record written yet (once the producer stopped)
+    uint64_t unreportedLoss() const { return lost.load(std::memory_order_relaxed); }
+};
+
+class TraceRecorder {
+private:
+    std::ofstream out;
+    std::chrono::steady_clock::time_point start_time;
+    size_t ring_capacity;
+    uint64_t recorder_id;  // Distinguishes recorders in per-thread ring caches
+
+    std::mutex rings_mutex;
+    std::vector<std::unique_ptr<TraceRing>> rings;  // Index = thread slot
+
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> stopping;
+    std::atomic<bool> drain_requested;  // A ring passed its high-water mark
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    std::thread writer;
+
+    TraceRing* threadRing();
+    void writerLoop();
+    void drainAll(bool final);
+
+public:
+    /**
+     * Open a trace file and write its header
+     * @param path: Output file
+     * @param parent_ids: Tree shape, as passed to NaryTreeLock::buildTree
+     * @param ring_capacity: Records buffered per thread before dropping
+     */
+    TraceRecorder(const std::string& path, const std::vector<int>& parent_ids,
+                  size_t ring_capacity = 1 << 16);
+    ~TraceRecorder();  // Drains all rings and closes the file
+
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+    // Nanoseconds since the recorder was created
+    uint64_t now() const;
+
+    void record(TraceOp op, int node_id, int user_id, bool result, uint64_t timestamp_ns);
+
+    uint64_t droppedRecords() const { return dropped.load(); }
+};
+
+/**
+ * Loads a trace written by TraceRecorder
+ */
+class TraceReader {
+private:
+    std::vector<int> parent_ids;
+    std::vector<std::vector<TraceRecord>> thread_records;  // Index = thread slot, gaps removed
+    size_t record_count;
+    uint64_t dropped_records;
+    size_t gap_count;
+
+public:
+    // Throws std::runtime_error for unreadable files, a header that is not
+    // one tree, and thread slots or record counts the file cannot hold
+    explicit TraceReader(const std::string& path);
+
+    const std::vector<int>& parentIds() const { return parent_ids; }
+    const std::vector<std::vector<TraceRecord>>& threads() const { return thread_records; }
+    size_t recordCount() const { return record_count; }
+
+    // Records the recorder had to drop, and in how many places. A lossy
+    // trace does not replay faithfully: later results depend on the
+    // missing calls.
+    uint64_t droppedRecords() const { return dropped_records; }
+    size_t gapCount() const { return gap_count; }
+};
+
+#endif // TRACE_RECORDER_H
@@ -0,0 +1,243 @@
+#include "nary_tree_lock.h"
+#include "trace_recorder.h"
+#include "latency_histogram.h"
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+using namespace std;
+
+/**
+ * Trace Replay Driver
+ *
+ * Rebuilds the tree recorded in a trace and replays every recorded thread
+ * on its own thread, reporting throughput and per-operation latency.
+ *
+ * Usage:
+ *   trace_replay <trace-file> [--speed original|max] [--fanout N]
+ *                [--upgrade-timeout-us N]
+ *
+ *   --speed original  issue each call at its recorded offset (default)
+ *   --speed max       issue calls back to back
+ *   --fanout N        run N copies of every recorded thread; copy k uses
+ *                     user IDs shifted by k * (max user + 1) so copies
+ *                     contend as distinct users on the same nodes
+ *   --upgrade-timeout-us N
+ *                     drain timeout for replayed upgradeLockQueued calls
+ *                     (not recorded in the trace; default 1000)
+ *   --allow-lossy     replay a trace whose recorder dropped calls. Results
+ *                     after a gap depend on the missing calls, so
+ *                     mismatches are expected; refused by default.
+ *
+ * With --fanout 1 --speed original the number of calls whose result
+ * differs from the recorded one is reported too. It is informational: the
+ * replay preserves per-thread order and timing but not the exact
+ * interleaving, so concurrent calls can still decide differently. Other
+ * modes change the interleaving on purpose and do not report it.
+ */
+
+struct ReplayResult {
+    LatencyHistogram latency[4];  // Indexed by TraceOp
+    uint64_t succeeded[4] = {0, 0, 0, 0};
+    uint64_t mismatched = 0;      // Result differs from the recorded one
+};
+
+const char* opName(int op) {
+    switch (op) {
+        case 0: return "lock";
+        case 1: return "unlock";
+        case 2: return "upgradeLock";
+        default: return "upgradeLockQueued";
+    }
+}
+
+void printUsage() {
+    cout << "Usage: trace_replay <trace-file> [--speed original|max] [--fanout N]"
+         << " [--upgrade-timeout-us N] [--allow-lossy]" << endl;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printUsage();
+        return 1;
+    }
+
+    string path = argv[1];
+    bool original_speed = true;
+    int fanout = 1;
+    int upgrade_timeout_us = 1000;
+    bool allow_lossy = false;
+
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--speed" && i + 1 < argc) {
+            string speed = argv[++i];
+            if (speed == "max") {
+                original_speed = false;
+            } else if (speed != "original") {
+                printUsage();
+                return 1;
+            }
+        } else if (arg == "--fanout" && i + 1 < argc) {
+            fanout = atoi(argv[++i]);
+            if (fanout < 1) {
+                printUsage();
+                return 1;
+            }
+        } else if (arg == "--upgrade-timeout-us" && i + 1 < argc) {
+            upgrade_timeout_us = atoi(argv[++i]);
+            if (upgrade_timeout_us < 0) {
+                printUsage();
+                return 1;
+            }
+        } else if (arg == "--allow-lossy") {
+            allow_lossy = true;
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+
+    try {
+        TraceReader trace(path);
+        if (trace.recordCount() == 0) {
+            throw runtime_error("trace contains no operations");
+        }
+
+        if (trace.droppedRecords() > 0) {
+            cout << "Trace is lossy: " << trace.droppedRecords() << " calls dropped in "
+                 << trace.gapCount() << " places while recording (ring buffer full)." << endl;
+            if (!allow_lossy) {
+                cout << "Replay results would not match the recording. Record again with a"
+                     << " larger ring_capacity, or pass --allow-lossy." << endl;
+                return 1;
+            }
+            cout << "Replaying anyway; expect results differing from the recording." << endl;
+        }
+
+        // Rebuild the recorded tree
+        const vector<int>& parents = trace.parentIds();
+        vector<string> names;
+        for (size_t i = 0; i < parents.size(); i++) {
+            names.push_back("Node_" + to_string(i));
+        }
+
+        NaryTreeLock tree;
+        tree.buildTree(names, parents);
+
+        // Common time origin and user ID stride for fan-out copies
+        uint64_t trace_start = UINT64_MAX;
+        int max_user = 0;
+        for (const auto& records : trace.threads()) {
+            for (const TraceRecord& record : records) {
+                trace_start = min(trace_start, record.timestamp());
+                max_user = max(max_user, static_cast<int>(record.user_id));
+            }
+        }
+        int user_stride = max_user + 1;
+
+        cout << "Trace: " << path << endl;
+        cout << "Nodes: " << parents.size()
+             << ", recorded threads: " << trace.threads().size()
+             << ", records: " << trace.recordCount() << endl;
+        cout << "Speed: " << (original_speed ? "original" : "max")
+             << ", fan-out: " << fanout << endl;
+
+        size_t replay_threads = trace.threads().size() * fanout;
+        vector<ReplayResult> results(replay_threads);
+        auto replay_start = chrono::steady_clock::now();
+
+        auto replay_func = [&](size_t index) {
+            const vector<TraceRecord>& records = trace.threads()[index / fanout];
+            int user_offset = static_cast<int>(index % fanout) * user_stride;
+            ReplayResult& result = results[index];
+
+            for (const TraceRecord& record : records) {
+                if (original_speed) {
+                    this_thread::sleep_until(replay_start +
+                        chrono::nanoseconds(record.timestamp() - trace_start));
+                }
+
+                int op = static_cast<int>(record.op());
+                int user_id = record.user_id + user_offset;
+
+                auto op_start = chrono::steady_clock::now();
+                bool ok;
+                switch (record.op()) {
+                    case TraceOp::Lock:
+                        ok = tree.lock(record.node_id, user_id);
+                        break;
+                    case TraceOp::Unlock:
+                        ok = tree.unlock(record.node_id, user_id);
+                        break;
+                    case TraceOp::UpgradeLock:
+                        ok = tree.upgradeLock(record.node_id, user_id);
+                        break;
+                    default:
+                        ok = tree.upgradeLockQueued(record.node_id, user_id,
+                                                    chrono::microseconds(upgrade_timeout_us));
+                        break;
+                }
+                auto op_end = chrono::steady_clock::now();
+
+                result.latency[op].record(
+                    chrono::duration_cast<chrono::nanoseconds>(op_end - op_start).count());
+                if (ok) {
+                    result.succeeded[op]++;
+                }
+                if (ok != record.result()) {
+                    result.mismatched++;
+                }
+            }
+        };
+
+        vector<thread> threads;
+        for (size_t t = 0; t < replay_threads; t++) {
+            threads.push_back(thread(replay_func, t));
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        auto replay_end = chrono::steady_clock::now();
+
+        // Merge per-thread results
+        ReplayResult total;
+        for (const ReplayResult& result : results) {
+            for (int op = 0; op < 4; op++) {
+                total.latency[op].merge(result.latency[op]);
+                total.succeeded[op] += result.succeeded[op];
+            }
+            total.mismatched += result.mismatched;
+        }
+
+        uint64_t operations = 0;
+        for (int op = 0; op < 4; op++) {
+            operations += total.latency[op].count();
+        }
+
+        double seconds = chrono::duration<double>(replay_end - replay_start).count();
+        cout << "\nReplayed " << operations << " operations in "
+             << fixed << setprecision(2) << seconds * 1000.0 << " ms ("
+             << operations / seconds / 1e6 << " M ops/s)" << endl;
+        if (fanout == 1 && original_speed) {
+            cout << "Results differing from the recording: " << total.mismatched
+                 << " (informational; concurrent calls may interleave differently)" << endl;
+        }
+
+        for (int op = 0; op < 4; op++) {
+            if (total.latency[op].count() == 0) continue;
+            cout << "\n" << opName(op) << " succeeded: " << total.succeeded[op] << endl;
+            total.latency[op].print(cout, string(opName(op)) + " latency");
+        }
+    } catch (const exception& e) {
+        cout << "Replay failed: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,165 @@
+#include "unlock_notifier.h"
+#include <stdexcept>
+#include <chrono>
+#ifdef __linux__
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+// UnlockNotifier Implementation
+UnlockNotifier::UnlockNotifier(size_t capacity)
+    : enqueue_pos(0), dequeue_pos(0), signaled(false), overflowed(false), dropped(0) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    cells.reset(new Cell[size]);
+    for (size_t i = 0; i < size; i++) {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    mask = size - 1;
+
+#ifdef __linux__
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        throw std::runtime_error("cannot create eventfd for unlock notifications");
+    }
+#endif
+}
+
+UnlockNotifier::~UnlockNotifier() {
+#ifdef __linux__
+    close(event_fd);
+#endif
+}
+
+uint64_t UnlockNotifier::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Bounded MPMC enqueue: each cell's sequence number says whether it is
+ * free for the producer at that position (sequence == pos) or holds an
+ * event for the consumer (sequence == pos + 1)
+ */
+bool UnlockNotifier::push(const UnlockEvent& event) {
+    uint64_t pos = enqueue_pos.load(std::memory_order_relaxed);
+
+    while (true) {
+        Cell& cell = cells[pos & mask];
+        uint64_t sequence = cell.sequence.load(std::memory_order_acquire);
+        int64_t diff = static_cast<int64_t>(sequence) - static_cast<int64_t>(pos);
+
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell.event = event;
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;  // Full
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool UnlockNotifier::pop(UnlockEvent& event) {
+    uint64_t pos = dequeue_pos.load(std::memory_order_relaxed);
+
+    while (true) {
+        Cell& cell = cells[pos & mask];
+        uint64_t sequence = cell.sequence.load(std::memory_order_acquire);
+        int64_t diff = static_cast<int64_t>(sequence) - static_cast<int64_t>(pos + 1);
+
+        if (diff == 0) {
+            if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                event = cell.event;
+                cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;  // Empty
+        } else {
+            pos = dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Queue an event and wake the consumer if it is not already woken
+ */
+void UnlockNotifier::publish(const UnlockEvent& event) {
+    if (!push(event)) {
+        dropped.fetch_add(1);
+        overflowed.store(true);
+    }
+
+    // Only the first publisher after a drain pays for the syscall
+    if (!signaled.exchange(true)) {
+#ifdef __linux__
+        uint64_t one = 1;
+        ssize_t written = write(event_fd, &one, sizeof(one));
+        (void)written;  // Can only fail if the counter would overflow
+#else
+        // Taking the mutex orders this with a waiter testing the flag
+        std::lock_guard<std::mutex> guard(wake_mutex);
+        wake.notify_all();
+#endif
+    }
+}
+
+/**
+ * Reset the eventfd, then take everything queued. A publisher that finds
+ * the signaled flag still set pushed before the flag was cleared, so its
+ * event is seen by the pops below.
+ */
+size_t UnlockNotifier::drain(std::vector<UnlockEvent>& out, bool* overflow) {
+#ifdef __linux__
+    uint64_t value;
+    ssize_t got = read(event_fd, &value, sizeof(value));
+    (void)got;  // EAGAIN when nothing was signaled
+#endif
+
+    signaled.store(false);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    size_t count = 0;
+    UnlockEvent event;
+    while (pop(event)) {
+        out.push_back(event);
+        count++;
+    }
+
+    bool lost = overflowed.exchange(false);
+    if (overflow) *overflow = lost;
+    return count;
+}
+
+bool UnlockNotifier::wait(int timeout_ms) {
+#ifdef __linux__
+    pollfd pfd;
+    pfd.fd = event_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+
+    return ready > 0;
+#else
+    std::unique_lock<std::mutex> guard(wake_mutex);
+    auto woken = [this] { return signaled.load(); };
+    if (timeout_ms < 0) {
+        wake.wait(guard, woken);
+        return true;
+    }
+    return wake.wait_for(guard, std::chrono::milliseconds(timeout_ms), woken);
+#endif
+}
@@ -0,0 +1,110 @@
+#ifndef UNLOCK_NOTIFIER_H
+#define UNLOCK_NOTIFIER_H
+
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#ifndef __linux__
+#include <mutex>
+#include <condition_variable>
+#endif
+
+/**
+ * Unlock Event Notification
+ *
+ * Delivers "node X became lockable" events from NaryTreeLock to an external
+ * scheduler, so it can wait on blocked nodes instead of polling them.
+ *
+ * Design:
+ * - Releasing threads push events into a bounded lock-free MPMC queue
+ * - An eventfd becomes readable when events are waiting; add fd() to an
+ *   epoll/poll set and call drain() when it fires
+ * - The eventfd is written only on the empty -> non-empty edge, so a burst
+ *   of wake-ups costs one syscall, not one per event
+ * - A full queue never blocks the releasing thread: the event is dropped
+ *   and overflow is reported by the next drain(), after which the
+ *   scheduler should re-check its waiting nodes
+ *
+ * The eventfd exists only on Linux. Elsewhere fd() returns -1 and wait()
+ * blocks on a condition variable signalled on the same edge.
+ *
+ * Subscriptions are registered on the tree, see NaryTreeLock::subscribeUnlock.
+ */
+
+struct UnlockEvent {
+    uint64_t subscription_id;
+    int32_t node_id;           // Subscribed node, lockable when published
+    int32_t released_node_id;  // Node whose release cleared the last conflict
+                               // (-1: already lockable when subscribed)
+    uint64_t timestamp_ns;     // steady_clock time of publication
+};
+
+static_assert(sizeof(UnlockEvent) == 24, "UnlockEvent must stay 24 bytes");
+
+class UnlockNotifier {
+private:
+    struct Cell {
+        std::atomic<uint64_t> sequence;
+        UnlockEvent event;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    uint64_t mask;
+#ifdef __linux__
+    int event_fd;
+#else
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+#endif
+
+    alignas(64) std::atomic<uint64_t> enqueue_pos;
+    alignas(64) std::atomic<uint64_t> dequeue_pos;
+    alignas(64) std::atomic<bool> signaled;  // Woken since the last drain
+    std::atomic<bool> overflowed;
+    std::atomic<uint64_t> dropped;
+
+    bool push(const UnlockEvent& event);
+    bool pop(UnlockEvent& event);
+
+public:
+    /**
+     * Create the queue and, on Linux, its eventfd
+     * @param capacity: Events buffered before dropping (rounded up to a
+     *                  power of two)
+     * Throws std::runtime_error if the eventfd cannot be created.
+     */
+    explicit UnlockNotifier(size_t capacity = 1 << 16);
+    ~UnlockNotifier();
+
+    UnlockNotifier(const UnlockNotifier&) = delete;
+    UnlockNotifier& operator=(const UnlockNotifier&) = delete;
+
+    // Readable (EPOLLIN) while events are waiting; -1 without eventfd
+#ifdef __linux__
+    int fd() const { return event_fd; }
+#else
+    int fd() const { return -1; }
+#endif
+
+    // Producer side, called by the tree on release
+    void publish(const UnlockEvent& event);
+
+    /**
+     * Append every waiting event to out
+     * @param overflow: set to true if events were dropped since the last
+     *                  drain (optional)
+     * @return number of events appended
+     */
+    size_t drain(std::vector<UnlockEvent>& out, bool* overflow = nullptr);
+
+    // Block until events are waiting or timeout_ms passes (-1 = forever)
+    bool wait(int timeout_ms);
+
+    uint64_t droppedEvents() const { return dropped.load(); }
+
+    // steady_clock time in nanoseconds, as used in UnlockEvent::timestamp_ns
+    static uint64_t now();
+};
+
+#endif // UNLOCK_NOTIFIER_H